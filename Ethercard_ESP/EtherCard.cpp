@@ -37,13 +37,48 @@ byte EtherCard::dhcpState = 0;     // start with init state
 
 uint8_t EtherCard::begin(const uint16_t size,
                          const uint8_t* macaddr,
-                         uint8_t csPin) {
+                         uint8_t csPin,
+                         uint32_t spiClock,
+                         const ENC28J60Layout* layout,
+                         bool fullDuplex) {
   using_dhcp = false;
+  copyMac(mymac, macaddr);
+  uint8_t rev = initialize(size, mymac, csPin, spiClock, layout, fullDuplex);
 #if ETHERCARD_STASH
-  Stash::initMap();
+  if (rev != 0)
+    Stash::initMap();  // the map follows the layout
 #endif
-  copyMac(mymac, macaddr);
-  return initialize(size, mymac, csPin);
+  return rev;
+}
+
+#define ETHERCARD_STATE(X) \
+  X(mymac) X(myip) X(netmask) X(broadcastip) X(gwip) X(dhcpip) X(dnsip) X(hisip) X(hisport) \
+  X(using_dhcp) X(persist_tcp_connection) X(delaycnt) X(dhcpState)
+
+void EtherCard::stateEtherCard(EtherCardState& from, const EtherCardState& to) {
+  ETHERCARD_STATE(ETHERCARD_SAVE_STATE)
+  ETHERCARD_STATE(ETHERCARD_LOAD_STATE)
+}
+
+static EtherCardState primaryState;  // holds the default controller while another one is selected
+static EtherCardState* currentState = &primaryState;
+
+// Like ENC28J60::select(), the stack keeps talking to its statics; they are
+// copied to the context of the controller left and loaded from the one chosen
+void EtherCard::select(EtherCardContext* context) {
+  EtherCardState* to = context ? &context->stack : &primaryState;
+  if (to == currentState)
+    return;
+  stateEtherCard(*currentState, *to);
+  stateTcpip(*currentState, *to);
+  stateDhcp(*currentState, *to);
+  stateDns(*currentState, *to);
+  stateUdpServer(*currentState, *to);
+#if ETHERCARD_STASH
+  Stash::switchState(*currentState, *to);
+#endif
+  ENC28J60::select(context);
+  currentState = to;
 }
 
 bool EtherCard::staticSetup(const uint8_t* my_ip,
@@ -85,6 +85,15 @@
 */
 #define ETHERCARD_STASH 1
 
+/** Enable reception of IP multicast.
+*   Setting this to zero removes joinGroup()/leaveGroup() and the IGMP replies;
+*   multicast can still be sent.
+*/
+#define ETHERCARD_IGMP 1
+
+/** Maximum number of multicast groups that can be joined at the same time. */
+#define ETHERCARD_MAX_GROUPS 4
+
 /** This type definition defines the structure of a UDP server event handler callback funtion */
 typedef void (*UdpServerCallback)(
   uint16_t dest_port,  ///< Port the packet was sent to
@@ -100,6 +109,99 @@ typedef void (*DhcpOptionCallback)(
   const byte *data,  ///< DHCP option data
   uint8_t len);      ///< Length of the DHCP option data
 
+#define DHCP_HOSTNAME_MAX_LEN 32
+#define UDPSERVER_MAXLISTENERS 8  //the maximum number of port listeners.
+
+/** A port the UDP server listens on */
+typedef struct {
+  UdpServerCallback callback;
+  uint16_t port;
+  bool listening;
+} UdpServerListener;
+
+/** Stack state of one ENC28J60, see EtherCard::select(). The members mirror the statics of the
+*   stack and are only meant to be touched by select(); a new context describes a controller that
+*   still has to be set up with EtherCard::begin().
+*/
+struct EtherCardState {
+  // EtherCard.cpp
+  uint8_t mymac[ETH_LEN] = {};
+  uint8_t myip[IP_LEN] = {};
+  uint8_t netmask[IP_LEN] = {};
+  uint8_t broadcastip[IP_LEN] = {};
+  uint8_t gwip[IP_LEN] = {};
+  uint8_t dhcpip[IP_LEN] = {};
+  uint8_t dnsip[IP_LEN] = {};
+  uint8_t hisip[IP_LEN] = {};
+  uint16_t hisport = HTTP_PORT;
+  bool using_dhcp = false;
+  bool persist_tcp_connection = false;
+  uint16_t delaycnt = 0;
+  byte dhcpState = 0;
+  // tcpip.cpp
+  uint8_t tcpclient_src_port_l = 1;
+  uint8_t tcp_fd = 0;
+  uint8_t tcp_client_state = 0;
+  uint8_t tcp_client_port_h = 0;
+  uint8_t tcp_client_port_l = 0;
+  uint8_t (*client_tcp_result_cb)(uint8_t, uint8_t, uint16_t, uint16_t) = NULL;
+  uint16_t (*client_tcp_datafill_cb)(uint8_t) = NULL;
+  uint8_t www_fd = 0;
+  void (*icmp_cb)(uint8_t *ip) = NULL;
+  uint8_t destmacaddr[ETH_LEN] = {};
+  boolean waiting_for_dns_mac = false;
+  boolean has_dns_mac = false;
+  boolean waiting_for_dest_mac = false;
+  boolean has_dest_mac = false;
+  uint8_t gwmacaddr[ETH_LEN] = {};
+  uint8_t waitgwmac = 0;
+  uint16_t info_data_len = 0;
+  uint8_t seqnum = 0xa;
+  uint8_t result_fd = 123;
+  const char *result_ptr = NULL;
+#if ETHERCARD_IGMP
+  uint8_t groups[ETHERCARD_MAX_GROUPS][IP_LEN] = {};
+  uint8_t groupCount = 0;
+#endif
+  // dhcp.cpp
+  char hostname[DHCP_HOSTNAME_MAX_LEN] = "Arduino-ENC28j60-00";
+  uint32_t currentXid = 0;
+  uint32_t stateTimer = 0;
+  uint32_t leaseStart = 0;
+  uint32_t leaseTime = 0;
+  uint8_t dhcpCustomOptionNum = 0;
+  DhcpOptionCallback dhcpCustomOptionCallback = NULL;
+  // dns.cpp
+  byte dnstid_l = 0;
+  // udpserver.cpp
+  UdpServerListener listeners[UDPSERVER_MAXLISTENERS] = {};
+  byte numListeners = 0;
+  // stash.cpp; the stash lives in the buffer memory of each controller
+  uint8_t stashMap[SCRATCH_MAP_SIZE] = {};
+  uint8_t stashBlock[SCRATCH_PAGE_SIZE] = {};  ///< Cached write block
+  uint8_t stashBlockNum = 0;
+};
+
+/** Driver and stack state of one ENC28J60, see EtherCard::select() */
+struct EtherCardContext : ENC28J60Context {
+  EtherCardState stack;
+};
+
+// select() copies the stack statics member by member, arrays element by element
+template <typename T>
+inline void copyState(T &dst, const T &src) {
+  dst = src;
+}
+
+template <typename T, size_t N>
+inline void copyState(T (&dst)[N], const T (&src)[N]) {
+  for (size_t i = 0; i < N; ++i)
+    copyState(dst[i], src[i]);
+}
+
+#define ETHERCARD_SAVE_STATE(name) copyState(from.name, name);
+#define ETHERCARD_LOAD_STATE(name) copyState(name, to.name);
+
 /** This class provides the main interface to a ENC28J60 based network interface card and is the class most users will use.
 *   @note   All TCP/IP client (outgoing) connections are made from source port in range 2816-3071. Do not use these source ports for other purposes.
 */
@@ -136,25 +238,25 @@ public:
   /**   @brief  Initialise the network interface
     *     @param  size Size of data buffer
     *     @param  macaddr Hardware address to assign to the network interface (6 bytes)
-    *     @param  csPin Arduino pin number connected to chip select. Default = 8
+    *     @param  csPin Arduino pin number connected to chip select. Default = ENC28J60_CS_PIN
+    *     @param  spiClock SPI clock in Hz. Default = ENC28J60_SPI_CLOCK
+    *     @param  layout Partition of the ENC28J60 buffer memory, see ENC28J60Layout. Default = NULL for the built-in split
+    *     @param  fullDuplex True for full duplex; the switch port has to be forced to full duplex too. Default = false
     *     @return <i>uint8_t</i> Firmware version or zero on failure.
     */
-#if defined(__AVR__)
-  static uint8_t begin(const uint16_t size, const uint8_t *macaddr,
-                       uint8_t csPin = 8);
-#endif
-#if defined(ESP8266)
-  static uint8_t begin(const uint16_t size, const uint8_t *macaddr,
-                       uint8_t csPin = 15);
-#endif
-#if defined(ESP32)
-  static uint8_t begin(const uint16_t size, const uint8_t *macaddr,
-                       uint8_t csPin = 5);
-#endif
-#if defined(__STM32F1__)
   static uint8_t begin(const uint16_t size, const uint8_t *macaddr,
-                       uint8_t csPin = PA8);
-#endif
+                       uint8_t csPin = ENC28J60_CS_PIN,
+                       uint32_t spiClock = ENC28J60_SPI_CLOCK,
+                       const ENC28J60Layout* layout = NULL,
+                       bool fullDuplex = false);
+
+  /**   @brief  Switch the stack and the driver to another ENC28J60
+    *     @param  context State of the controller to talk to from now on, NULL for the default one
+    *     @note   Each controller has its own addresses, ARP, DHCP, DNS and TCP state, UDP listeners and stash. Bring a
+    *             new one up by selecting its context and calling begin() and staticSetup() or dhcpSetup() as usual.
+    *     @note   Only the data buffer is shared; it holds the frame being handled, so finish with one before switching.
+    */
+  static void select(EtherCardContext *context);
   /**   @brief  Configure network interface with static IP
     *     @param  my_ip IP address (4 bytes). 0 for no change.
     *     @param  gw_ip Gateway address (4 bytes). 0 for no change. Default = 0
@@ -183,6 +285,13 @@ public:
     */
   static uint16_t packetLoop(uint16_t plen);
 
+  /**   @brief  Parse a frame received with packetReceiveBatch()
+    *     @param  pkt Descriptor of the frame
+    *     @return <i>uint16_t</i> Offset of TCP payload data in data buffer or zero if packet processed
+    *     @note   The frame is copied into the data buffer first (unless it already lives there)
+    */
+  static uint16_t packetLoop(const PacketDescriptor &pkt);
+
   /**   @brief  Accept a TCP/IP connection
     *     @param  port IP port to accept on - do nothing if wrong port
     *     @param  plen Number of bytes in packet
@@ -254,6 +363,17 @@ public:
   static void sendUdp(const char *data, uint8_t len, uint16_t sport,
                       const uint8_t *dip, uint16_t dport);
 
+  /**   @brief  Stream captured frames (see setCapture) to a collector as pcap over UDP
+    *     @param  dip Pointer to 4 byte collector IP address
+    *     @param  dport Collector port
+    *     @param  sport Source port
+    *     @param  header True to start with the pcap file header, for the first datagram of a stream
+    *     @return <i>uint8_t</i> Number of frames sent in one datagram, 0 if none were waiting or the buffer cannot hold one
+    *     @note   Uses the data buffer like sendUdp(), call it from the loop between packetLoop() calls.
+    *     @note   The datagrams concatenated form a pcap file, e.g. socat -u UDP-RECV:port - > capture.pcap
+    */
+  static uint8_t captureSend(const uint8_t *dip, uint16_t dport, uint16_t sport, bool header = false);
+
   /**   @brief  Resister the function to handle ping events
     *     @param  cb Pointer to function
     */
@@ -280,6 +400,30 @@ public:
     */
   static const char *tcpReply(uint8_t fd);
 
+  /**   @brief  Drop frames nobody in the stack is interested in before their payload is read from the ENC28J60
+    *     @note   Keeps ARP and ICMP for our IP, all TCP to our IP, and UDP to registered listeners and to the
+    *             DHCP, DNS and NTP clients. Applications that parse other frames themselves must not use this.
+    */
+  static void enableEarlyDrop();
+
+  /**   @brief  Go back to copying every received frame completely
+    */
+  static void disableEarlyDrop();
+
+  /**   @brief  Join an IP multicast group
+    *     @param  group Multicast IP address (4 bytes), 224.0.0.0 to 239.255.255.255
+    *     @return <i>bool</i> True on success, false if the address is no multicast address or the group table is full
+    *     @note   Programs the ENC28J60 hash table filter and sends an IGMPv2 membership report; queries are answered
+    *             from packetLoop(). UDP to the group goes to the registered UDP server listeners.
+    */
+  static bool joinGroup(const uint8_t *group);
+
+  /**   @brief  Leave an IP multicast group
+    *     @param  group Multicast IP address (4 bytes)
+    *     @return <i>bool</i> True if the group was joined before
+    */
+  static bool leaveGroup(const uint8_t *group);
+
   /**   @brief  Configure TCP connections to be persistent or not
     *     @param  persist True to maintain TCP connection. False to finish TCP connection after first packet.
     */
@@ -307,6 +451,12 @@ public:
     */
   static bool udpServerListening();  //called by tcpip, in packetLoop
 
+  /**   @brief  Check if a UDP server callback is listening on a port
+    *     @param  port Port to check
+    *     @return <i>bool</i> True if a listener for this port exists and is not paused
+    */
+  static bool udpServerListeningOnPort(uint16_t port);
+
   /**   @brief  Passes packet to UDP Server
     *     @param  len Not used
     *     @return <i>bool</i> True if packet processed
@@ -418,6 +568,14 @@ public:
   /**   @brief  Return the payload length of the current Tcp package
     */
   static uint16_t getTcpPayloadLength();
+
+private:
+  // save the statics of each part of the stack to one context and load them from another, see select()
+  static void stateEtherCard(EtherCardState &from, const EtherCardState &to);
+  static void stateTcpip(EtherCardState &from, const EtherCardState &to);
+  static void stateDhcp(EtherCardState &from, const EtherCardState &to);
+  static void stateDns(EtherCardState &from, const EtherCardState &to);
+  static void stateUdpServer(EtherCardState &from, const EtherCardState &to);
 };
 
 extern EtherCard ether;  //!< Global presentation of EtherCard class
@@ -120,14 +120,9 @@ typedef struct
   byte chaddr[16], sname[64], file[128];
 } DHCPdata;
 
-#define DHCP_SERVER_PORT 67
-#define DHCP_CLIENT_PORT 68
-
 // timeouts im ms
 #define DHCP_REQUEST_TIMEOUT 10000
 
-#define DHCP_HOSTNAME_MAX_LEN 32
-
 // RFC 2132 Section 3.3:
 // The time value of 0xffffffff is reserved to represent "infinity".
 #define DHCP_INFINITE_LEASE 0xffffffff
@@ -142,6 +137,15 @@ static byte *bufPtr;
 static uint8_t dhcpCustomOptionNum = 0;
 static DhcpOptionCallback dhcpCustomOptionCallback = NULL;
 
+#define DHCP_STATE(X) \
+  X(hostname) X(currentXid) X(stateTimer) X(leaseStart) X(leaseTime) \
+  X(dhcpCustomOptionNum) X(dhcpCustomOptionCallback)
+
+void EtherCard::stateDhcp(EtherCardState &from, const EtherCardState &to) {
+  DHCP_STATE(ETHERCARD_SAVE_STATE)
+  DHCP_STATE(ETHERCARD_LOAD_STATE)
+}
+
 extern uint8_t allOnes[];  // = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
 
 static void addToBuf(byte b) {
@@ -510,6 +514,7 @@ void EtherCard::DhcpStateMachine(uint16_t len) {
         stateTimer = millis();
       } else {
         if (millis() - stateTimer > DHCP_REQUEST_TIMEOUT) {
+          NETSTAT_INC(dhcpTimeouts);
           dhcpState = DHCP_STATE_INIT;
         }
       }
@@ -525,6 +530,7 @@ void EtherCard::DhcpStateMachine(uint16_t len) {
         dhcpState = DHCP_STATE_BOUND;
       } else {
         if (millis() - stateTimer > DHCP_REQUEST_TIMEOUT) {
+          NETSTAT_INC(dhcpTimeouts);
           dhcpState = DHCP_STATE_INIT;
         }
       }
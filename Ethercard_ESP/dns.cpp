@@ -10,7 +10,11 @@
 #define gPB ether.buffer
 
 static byte dnstid_l;  // a counter for transaction ID
-#define DNSCLIENT_SRC_PORT_H 0xE0
+
+void EtherCard::stateDns(EtherCardState &from, const EtherCardState &to) {
+  ETHERCARD_SAVE_STATE(dnstid_l)
+  ETHERCARD_LOAD_STATE(dnstid_l)
+}
 
 static void dnsRequest(const char *hostname, bool fromRam) {
   ++dnstid_l;  // increment for next request, finally wrap
@@ -105,8 +109,10 @@ bool EtherCard::dnsLookup(const char *name, bool fromRam) {
   start = millis();
   while (hisip[0] == 0) {
     //        if (uint16_t(millis()) - start >= 30000)
-    if (uint16_t(millis()) - start >= 5000)
+    if (uint16_t(millis()) - start >= 5000) {
+      NETSTAT_INC(dnsTimeouts);
       return false;  //timout waiting for dns response
+    }
 
     word len = packetReceive();
     if (len > 0 && packetLoop(len) == 0)  //packet not handled by tcp/ip packet loop
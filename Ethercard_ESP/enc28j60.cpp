@@ -14,11 +14,17 @@
 
 #include <Arduino.h>  // Arduino 1.0
 #include "enc28j60.h"
-#include <SPI.h>
+#include "enc28j60_bus.h"
+#if defined(ESP32)
+#include "soc/gpio_reg.h"
+#elif defined(ESP8266)
+#include "esp8266_peri.h"
+#endif
 
 uint16_t ENC28J60::bufferSize;
 bool ENC28J60::broadcast_enabled = false;
 bool ENC28J60::promiscuous_enabled = false;
+NetStats ENC28J60::stats;
 
 bool ENC28J60::tagging_enabled = false;
 bool ENC28J60::received_tagged = false;
@@ -26,12 +32,13 @@ uint16_t ENC28J60::vlanID = 0;
 uint8_t ENC28J60::vlan_TCI_PCP = 0;
 uint8_t ENC28J60::vlan_TCI_DEI = 0;
 
-#define MY_CS    5
-#define MY_SCLK 18
-#define MY_MISO 19
-#define MY_MOSI 23
-
+#if defined(ESP32)
 SPIClass MY_SPI(VSPI);
+#else
+#define MY_SPI SPI
+#endif
+SPIClass* SpiClassBus::bus = &MY_SPI;  // bus of the selected controller
+SPISettings SpiClassBus::settings(ENC28J60_SPI_MIN_CLOCK, MSBFIRST, SPI_MODE0);
 
 // ENC28J60 Control Registers
 // Control register definitions are a combination of address,
@@ -56,10 +63,10 @@ SPIClass MY_SPI(VSPI);
 #define ERXST   (0x08 | 0x00)
 #define ERXND   (0x0A | 0x00)
 #define ERXRDPT (0x0C | 0x00)
-// #define ERXWRPT         (0x0E|0x00)
+#define ERXWRPT (0x0E | 0x00)
 #define EDMAST (0x10 | 0x00)
 #define EDMAND (0x12 | 0x00)
-// #define EDMADST         (0x14|0x00)
+#define EDMADST (0x14 | 0x00)
 #define EDMACS (0x16 | 0x00)
 // Bank 1 registers
 #define EHT0  (0x00 | 0x20)
@@ -79,7 +86,7 @@ SPIClass MY_SPI(VSPI);
 #define EPMM6 (0x0E | 0x20)
 #define EPMM7 (0x0F | 0x20)
 #define EPMCS (0x10 | 0x20)
-// #define EPMO            (0x14|0x20)
+#define EPMO (0x14 | 0x20)
 #define EWOLIE  (0x16 | 0x20)
 #define EWOLIR  (0x17 | 0x20)
 #define ERXFCON (0x18 | 0x20)
@@ -142,6 +149,10 @@ SPIClass MY_SPI(VSPI);
 #define EIR_WOLIF  0x04
 #define EIR_TXERIF 0x02
 #define EIR_RXERIF 0x01
+// ENC28J60 EFLOCON Register Bit Definitions
+#define EFLOCON_FULDPXS 0x04
+#define EFLOCON_FCEN1   0x02
+#define EFLOCON_FCEN0   0x01
 // ENC28J60 ESTAT Register Bit Definitions
 #define ESTAT_INT     0x80
 #define ESTAT_LATECOL 0x10
@@ -235,6 +246,12 @@ SPIClass MY_SPI(VSPI);
 #define PHCON2_TXDIS   0x2000
 #define PHCON2_JABBER  0x0400
 #define PHCON2_HDLDIS  0x0100
+// ENC28J60 PHY PHIE Register Bit Definitions
+#define PHIE_PLNKIE 0x0010
+#define PHIE_PGEIE  0x0002
+// ENC28J60 PHY PHIR Register Bit Definitions
+#define PHIR_PLNKIF 0x0010
+#define PHIR_PGIF   0x0004
 
 // ENC28J60 Packet Control Byte Bit Definitions
 #define PKTCTRL_PHUGEEN   0x08
@@ -258,153 +275,240 @@ SPIClass MY_SPI(VSPI);
 #define FULL_SPEED 1  // switch to full-speed SPI for bulk transfers
 
 static byte Enc28j60Bank;
-static byte selectPin;
-
+static byte selectPin = ENC28J60_CS_PIN;
+static SPIClass* spiBus = NULL;  // bus given to initSPI(SPIClass*), NULL for the default
+static byte chipRevision;  // raw EREVID value, 0 until initialize() has read it
+static uint32_t spiClock = ENC28J60_SPI_MIN_CLOCK;
+
+// buffer memory layout, see ENC28J60Layout
+static uint16_t rxStop = RXSTOP_INIT;
+static uint16_t txStart = TXSTART_INIT;
+static uint8_t txSlots = ETHERCARD_TX_SLOTS;
+static uint16_t scratchStart = SCRATCH_START;
+static uint16_t scratchLimit = SCRATCH_LIMIT;
+static uint16_t endRam = ENC_HEAP_END;  // enc_malloc() allocates downwards to scratchLimit
+static byte txSlot;                     // slot the next frame is written to
+static uint16_t gNextPacketPtr = RXSTART_INIT;  // next frame in the RX ring
+static bool unreleasedPacket = false;
+static bool fullDuplex = false;
+static bool flowControl = false;  // watch the fill level of the RX ring
+static bool backpressure = false;
+
+static ENC28J60Context primaryContext;        // holds the default controller while another one is selected
+static ENC28J60Context* currentContext = NULL;
+// interrupt flags of the selected controller; they stay in its context, as the
+// interrupt handler may set them at any time
+static ENC28J60Events* events = &primaryContext.events;
+
+#define LINK_POLL_INTERVAL 250  // ms between EIR checks for a link change
+static bool linkUp;  // link state as of the last link change interrupt
+static uint32_t lastLinkPoll;
+static LinkCallback linkCallback = NULL;
 #ifdef __AVR__
-void ENC28J60::initSPI() {
-  pinMode(MY_CS, OUTPUT);
-  digitalWrite(MY_CS, HIGH);
-  pinMode(MY_MOSI, OUTPUT);
-  pinMode(MY_SCLK, OUTPUT);
-  pinMode(MY_MISO, INPUT);
+void AvrSpiBus::init() {
+  pinMode(ENC28J60_CS_PIN, OUTPUT);
+  digitalWrite(ENC28J60_CS_PIN, HIGH);
+  pinMode(ENC28J60_MOSI_PIN, OUTPUT);
+  pinMode(ENC28J60_SCLK_PIN, OUTPUT);
+  pinMode(ENC28J60_MISO_PIN, INPUT);
 
-  digitalWrite(MY_MOSI, HIGH);
-  digitalWrite(MY_MOSI, LOW);
-  digitalWrite(MY_SCLK, LOW);
+  digitalWrite(ENC28J60_MOSI_PIN, HIGH);
+  digitalWrite(ENC28J60_MOSI_PIN, LOW);
+  digitalWrite(ENC28J60_SCLK_PIN, LOW);
 
   SPCR = bit(SPE) | bit(MSTR);  // 8 MHz @ 16
   bitSet(SPSR, SPI2X);
 }
+
+// picks the fastest of F_CPU / 2 .. F_CPU / 128 that is not above hz
+void AvrSpiBus::setClock(uint32_t hz) {
+  // SPR1:SPR0 and SPI2X for the dividers 2, 4, 8, ... 128
+  static const byte spr[] = { 0, 0, 1, 1, 2, 2, 3 };
+  byte div = 0;
+  while (div < 6 && (F_CPU >> (div + 1)) > hz)
+    ++div;
+  SPCR = (SPCR & ~(bit(SPR1) | bit(SPR0))) | spr[div];
+  if ((div & 1) == 0 && div < 6)
+    bitSet(SPSR, SPI2X);
+  else
+    bitClear(SPSR, SPI2X);
+}
+#endif
+
+void SpiClassBus::useBus(SPIClass* spi) {
+  bus = spi ? spi : &MY_SPI;
+}
+
+void SpiClassBus::init() {
+  if (bus != &MY_SPI)
+    return;  // set up by whoever handed it to initSPI(SPIClass*)
+#if defined(ESP32)
+  MY_SPI.begin(ENC28J60_SCLK_PIN, ENC28J60_MISO_PIN, ENC28J60_MOSI_PIN, ENC28J60_CS_PIN);
 #else
+  MY_SPI.begin();
+#endif
+  MY_SPI.setBitOrder(MSBFIRST);
+}
+
 void ENC28J60::initSPI() {
-  MY_SPI.begin(MY_SCLK, MY_MISO, MY_MOSI, MY_CS);  //25,26,27,33
-  MY_SPI.setBitOrder(SPI_MSBFIRST);
+  ENC28J60_BUS::init();
 }
-#endif
 
 void ENC28J60::initSPI(SPIClass* _mySPI) {
-  MY_SPI = *_mySPI;
+  spiBus = _mySPI;
+  ENC28J60_BUS::useBus(spiBus);
 }
 
 SPIClass& ENC28J60::getSPIinstance(void) {
-  return MY_SPI;
+  return spiBus ? *spiBus : MY_SPI;
 }
 
-static void enableChip() {
-  digitalWrite(selectPin, LOW);
+// Highest SPI clock for a given EREVID value. All released revisions
+// (B1, B4, B5 and B7) are specified for 20 MHz; anything else is either
+// unknown silicon or a garbled read, so stay at the conservative floor.
+static uint32_t maxSpiClock(byte rev) {
+  switch (rev) {
+    case 0x02:  // B1
+    case 0x04:  // B4
+    case 0x05:  // B5
+    case 0x06:  // B7
+      return ENC28J60_SPI_MAX_CLOCK;
+    default:
+      return ENC28J60_SPI_MIN_CLOCK;
+  }
 }
 
-static void disableChip() {
-  digitalWrite(selectPin, HIGH);
+uint32_t ENC28J60::setSpiClock(uint32_t hz) {
+  uint32_t ceiling = maxSpiClock(chipRevision);
+  if (hz > ceiling)
+    hz = ceiling;
+  if (hz < ENC28J60_SPI_SLOWEST_CLOCK)
+    hz = ENC28J60_SPI_SLOWEST_CLOCK;
+  spiClock = hz;
+  ENC28J60_BUS::setClock(spiClock);
+  return spiClock;
 }
 
-#ifdef __AVR__  // if i am an AVR, use this custom SPI transfer routine.
-static void xferSPI(byte data) {
-  SPDR = data;
-  while (!(SPSR & (1 << SPIF)))
-    ;
+uint32_t ENC28J60::getSpiClock() {
+  return spiClock;
 }
 
-static byte readOp(byte op, byte address) {
-  enableChip();
-  xferSPI(op | (address & ADDR_MASK));
-  xferSPI(0x00);
-  if (address & 0x80)
-    xferSPI(0x00);
-  byte result = SPDR;
-  disableChip();
-  return result;
-}
+// Chip select is toggled twice for every register access, so on the ESP
+// targets the pin is driven through the GPIO set/clear registers instead of
+// going through digitalWrite()
+#if defined(ESP32)
+static volatile uint32_t* csSetReg;
+static volatile uint32_t* csClrReg;
+static uint32_t csMask;
 
-static void writeOp(byte op, byte address, byte data) {
-  enableChip();
-  xferSPI(op | (address & ADDR_MASK));
-  xferSPI(data);
-  disableChip();
+static void initChipSelect() {
+  pinMode(selectPin, OUTPUT);
+  csMask = 1UL << (selectPin & 31);
+  csSetReg = (volatile uint32_t*)(selectPin < 32 ? GPIO_OUT_W1TS_REG : GPIO_OUT1_W1TS_REG);
+  csClrReg = (volatile uint32_t*)(selectPin < 32 ? GPIO_OUT_W1TC_REG : GPIO_OUT1_W1TC_REG);
 }
 
-static void readBuf(uint16_t len, byte* data) {
-  uint8_t nextbyte;
-  enableChip();
-  if (len != 0) {
-    xferSPI(ENC28J60_READ_BUF_MEM);
-
-    SPDR = 0x00;
-    while (--len) {
-      while (!(SPSR & (1 << SPIF)))
-        ;
-      nextbyte = SPDR;
+template <class Bus = ENC28J60_BUS>
+static void enableChip() {
+  Bus::begin();
+  *csClrReg = csMask;
+}
 
-      SPDR = 0x00;
-      *data++ = nextbyte;
-    }
-    while (!(SPSR & (1 << SPIF)))
-      ;
-    *data++ = SPDR;
-  }
+template <class Bus = ENC28J60_BUS>
+static void disableChip() {
+  *csSetReg = csMask;
+  Bus::end();
+}
+#elif defined(ESP8266)
+static uint16_t csMask;
 
-  disableChip();
+static void initChipSelect() {
+  pinMode(selectPin, OUTPUT);
+  csMask = selectPin < 16 ? 1 << selectPin : 0;  // GPIO16 is not on the GPOS/GPOC port
 }
 
-static void writeBuf(uint16_t len, const byte* data) {
-  enableChip();
-  if (len != 0) {
-    xferSPI(ENC28J60_WRITE_BUF_MEM);
+template <class Bus = ENC28J60_BUS>
+static void enableChip() {
+  Bus::begin();
+  if (csMask)
+    GPOC = csMask;
+  else
+    digitalWrite(selectPin, LOW);
+}
 
-    SPDR = *data++;
-    while (--len) {
-      uint8_t nextbyte = *data++;
-      while (!(SPSR & (1 << SPIF)))
-        ;
-      SPDR = nextbyte;
-    };
-    while (!(SPSR & (1 << SPIF)))
-      ;
-  }
+template <class Bus = ENC28J60_BUS>
+static void disableChip() {
+  if (csMask)
+    GPOS = csMask;
+  else
+    digitalWrite(selectPin, HIGH);
+  Bus::end();
+}
+#else
+static void initChipSelect() {
+  pinMode(selectPin, OUTPUT);
+}
 
-  disableChip();
+template <class Bus = ENC28J60_BUS>
+static void enableChip() {
+  Bus::begin();
+  digitalWrite(selectPin, LOW);
 }
 
-#else  // Else, use MY_SPI.transfer from SPI library.
+template <class Bus = ENC28J60_BUS>
+static void disableChip() {
+  digitalWrite(selectPin, HIGH);
+  Bus::end();
+}
+#endif
 
+// The opcodes are written once against the bus policy, see enc28j60_bus.h
+template <class Bus = ENC28J60_BUS>
 static byte readOp(byte op, byte address) {
-  enableChip();
-  byte result;
-  MY_SPI.transfer(op | (address & ADDR_MASK));
-  result = MY_SPI.transfer(0x00);
-  if (address & 0x80)
-    result = MY_SPI.transfer(0x00);
-  disableChip();
+  // MAC and MII registers may read wrong below ENC28J60_SPI_MIN_CLOCK (errata)
+  bool raise = (address & SPRD_MASK) && spiClock < ENC28J60_SPI_MIN_CLOCK;
+  if (raise)
+    Bus::setClock(ENC28J60_SPI_MIN_CLOCK);
+  enableChip<Bus>();
+  Bus::transfer(op | (address & ADDR_MASK));
+  byte result = Bus::transfer(0x00);
+  if (address & SPRD_MASK)
+    result = Bus::transfer(0x00);  // MAC and MII registers send a dummy byte first
+  disableChip<Bus>();
+  if (raise)
+    Bus::setClock(spiClock);
   return result;
 }
 
+template <class Bus = ENC28J60_BUS>
 static void writeOp(byte op, byte address, byte data) {
-  enableChip();
-  MY_SPI.transfer(op | (address & ADDR_MASK));
-  MY_SPI.transfer(data);
-  disableChip();
+  enableChip<Bus>();
+  Bus::transfer(op | (address & ADDR_MASK));
+  Bus::transfer(data);
+  disableChip<Bus>();
 }
 
-static void readBuf(uint16_t len, byte* data) {  //this bit ipsis literis from Seradisis's port
-  enableChip();
-  MY_SPI.transfer(ENC28J60_READ_BUF_MEM);
-  while (len--) {
-    *data++ = MY_SPI.transfer(0x00);
+template <class Bus = ENC28J60_BUS>
+static void readBuf(uint16_t len, byte* data) {
+  NETSTAT_ADD(spiBytes, len);
+  enableChip<Bus>();
+  if (len != 0) {
+    Bus::transfer(ENC28J60_READ_BUF_MEM);
+    Bus::read(data, len);
   }
-
-  disableChip();
+  disableChip<Bus>();
 }
 
-static void writeBuf(uint16_t len, const byte* data) {  //this bit ipsis literis from Seradisis's port
-  enableChip();
-  MY_SPI.transfer(ENC28J60_WRITE_BUF_MEM);
-
-  while (len--)
-    MY_SPI.transfer(*data++);
-
-  disableChip();
+template <class Bus = ENC28J60_BUS>
+static void writeBuf(uint16_t len, const byte* data) {
+  NETSTAT_ADD(spiBytes, len);
+  enableChip<Bus>();
+  if (len != 0) {
+    Bus::transfer(ENC28J60_WRITE_BUF_MEM);
+    Bus::write(data, len);
+  }
+  disableChip<Bus>();
 }
-#endif
 
 static void SetBank(byte address) {
   if ((address & BANK_MASK) != Enc28j60Bank) {
@@ -433,27 +537,121 @@ static void writeReg(byte address, uint16_t data) {
   writeRegByte(address + 1, data >> 8);
 }
 
-static uint16_t readPhyByte(byte address) {
+static bool phyScan = false;  // the MAC keeps reading PHSTAT2 into MIRD
+
+// MIRD holds whatever was read last until the first result is in; that takes
+// one MII cycle (10.24 us)
+static void startPhyScan() {
+  writeRegByte(MIREGADR, PHSTAT2);
+  writeRegByte(MICMD, MICMD_MIISCAN);
+  while (readRegByte(MISTAT) & MISTAT_NVALID)
+    ;
+}
+
+// a scan has to be stopped for other PHY accesses (data sheet 3.3.3)
+static void pausePhyScan() {
+  if (!phyScan)
+    return;
+  writeRegByte(MICMD, 0x00);
+  while (readRegByte(MISTAT) & MISTAT_BUSY)
+    ;
+}
+
+static void resumePhyScan() {
+  if (phyScan)
+    startPhyScan();
+}
+
+// runs an MII read cycle, the PHY register is in MIRD afterwards; resume the
+// scan once MIRD has been read
+static void startPhyRead(byte address) {
+  pausePhyScan();
   writeRegByte(MIREGADR, address);
   writeRegByte(MICMD, MICMD_MIIRD);
   while (readRegByte(MISTAT) & MISTAT_BUSY)
     ;
   writeRegByte(MICMD, 0x00);
-  return readRegByte(MIRD + 1);
+}
+
+// the high byte of a PHY register
+static uint16_t readPhyByte(byte address) {
+  startPhyRead(address);
+  uint16_t value = readRegByte(MIRD + 1);
+  resumePhyScan();
+  return value;
+}
+
+static uint16_t readPhy(byte address) {
+  startPhyRead(address);
+  uint16_t value = readReg(MIRD);
+  resumePhyScan();
+  return value;
 }
 
 static void writePhy(byte address, uint16_t data) {
+  pausePhyScan();
   writeRegByte(MIREGADR, address);
   writeReg(MIWR, data);
   while (readRegByte(MISTAT) & MISTAT_BUSY)
     ;
+  resumePhyScan();
+}
+
+#define DEFAULT_RXFILTER (ERXFCON_UCEN | ERXFCON_CRCEN | ERXFCON_PMEN | ERXFCON_BCEN)
+
+static byte rxFilter = DEFAULT_RXFILTER;  // ERXFCON outside promiscuous mode
+static bool filterBypassed = false;       // promiscuous mode is active
+
+static void updateFilter(byte set, byte clear) {
+  rxFilter = (rxFilter | set) & ~clear;
+  if (!filterBypassed)
+    writeRegByte(ERXFCON, rxFilter);
 }
 
-byte ENC28J60::initialize(uint16_t size, const byte* macaddr, byte CS) {
+// Checks a layout and derives the area boundaries from it; the RX ring has to end
+// on an odd address because ERXRDPT must always be odd (Rev. B7 Errata point 14)
+static bool applyLayout(const ENC28J60Layout* layout) {
+  endRam = ENC_HEAP_END;
+  txSlot = 0;
+  if (layout == NULL) {
+    rxStop = RXSTOP_INIT;
+    txSlots = ETHERCARD_TX_SLOTS;
+    txStart = TXSTART_INIT;
+    scratchStart = SCRATCH_START;
+    scratchLimit = SCRATCH_LIMIT;
+    return true;
+  }
+  uint32_t used = (uint32_t)layout->rxSize + (uint32_t)layout->txSlots * TX_SLOT_SIZE + layout->heapSize;
+  if (layout->rxSize < ENC28J60_MIN_RX_SIZE || (layout->rxSize & 1) || layout->txSlots == 0 || used > ENC28J60_MEMORY_SIZE)
+    return false;
+  rxStop = RXSTART_INIT + layout->rxSize - 1;
+  txSlots = layout->txSlots;
+  txStart = rxStop + 1;
+  scratchStart = txStart + txSlots * TX_SLOT_SIZE;
+  // whole pages only, the remainder goes to the heap
+  scratchLimit = scratchStart + ((ENC28J60_MEMORY_SIZE - layout->heapSize - scratchStart) & ~(SCRATCH_PAGE_SIZE - 1));
+  return true;
+}
+
+uint8_t ENC28J60::scratchPages() {
+  return (scratchLimit - scratchStart) >> SCRATCH_PAGE_SHIFT;
+}
+
+byte ENC28J60::initialize(uint16_t size, const byte* macaddr, byte CS, uint32_t clock, const ENC28J60Layout* layout, bool duplex) {
   bufferSize = size;
+  if (!applyLayout(layout))
+    return 0;
+  selectPin = CS;
+  if (clock == ENC28J60_SPI_CLOCK_AUTO) {
+    clock = calibrateSpiClock();
+    if (clock == 0)
+      return 0;
+  }
   initSPI();
-  selectPin = MY_CS;
-  pinMode(selectPin, OUTPUT);
+  // talk to the chip at the safe clock, or the slower one asked for, until its revision is known
+  chipRevision = 0;
+  setSpiClock(clock < ENC28J60_SPI_MIN_CLOCK ? clock : ENC28J60_SPI_MIN_CLOCK);
+  initChipSelect();
   disableChip();
 
   // Check if the ENC is in sleep mode or poweder up
@@ -467,19 +665,35 @@ byte ENC28J60::initialize(uint16_t size, const byte* macaddr, byte CS) {
   //LOG(LL_INFO, ("after while"));
   writeReg(ERXST, RXSTART_INIT);
   writeReg(ERXRDPT, RXSTART_INIT);
-  writeReg(ERXND, RXSTOP_INIT);
-  writeReg(ETXST, TXSTART_INIT);
-  writeReg(ETXND, TXSTOP_INIT);
-
-  writeRegByte(ERXFCON, ERXFCON_UCEN | ERXFCON_CRCEN | ERXFCON_PMEN | ERXFCON_BCEN);
-  writeReg(EPMM0, 0x303f);
+  writeReg(ERXND, rxStop);
+  gNextPacketPtr = RXSTART_INIT;  // the reset emptied the ring
+  unreleasedPacket = false;
+  writeReg(ETXST, txStart);
+  writeReg(ETXND, scratchStart - 1);
+
+  rxFilter = DEFAULT_RXFILTER;
+  filterBypassed = false;
+  writeRegByte(ERXFCON, rxFilter);
+  writeReg(EPMM0, 0x303f);  // ARP broadcasts: destination ff:ff:ff:ff:ff:ff and EtherType 0x0806
   writeReg(EPMCS, 0xf7f9);
+  // pause frames are only sent and honoured in full duplex
   writeRegByte(MACON1, MACON1_MARXEN | MACON1_TXPAUS | MACON1_RXPAUS);
   writeRegByte(MACON2, 0x00);
-  writeOp(ENC28J60_BIT_FIELD_SET, MACON3,
-          MACON3_PADCFG0 | MACON3_TXCRCEN | MACON3_FRMLNEN);
-  writeReg(MAIPG, 0x0C12);
-  writeRegByte(MABBIPG, 0x12);
+  fullDuplex = duplex;
+  flowControl = duplex;
+  backpressure = false;
+  if (fullDuplex) {
+    writeOp(ENC28J60_BIT_FIELD_SET, MACON3,
+            MACON3_PADCFG0 | MACON3_TXCRCEN | MACON3_FRMLNEN | MACON3_FULDPX);
+    writeReg(MAIPG, 0x0012);
+    writeRegByte(MABBIPG, 0x15);
+    writeReg(EPAUS, 0x1000);  // pause time in units of 512 bit times
+  } else {
+    writeOp(ENC28J60_BIT_FIELD_SET, MACON3,
+            MACON3_PADCFG0 | MACON3_TXCRCEN | MACON3_FRMLNEN);
+    writeReg(MAIPG, 0x0C12);
+    writeRegByte(MABBIPG, 0x12);
+  }
   writeReg(MAMXFL, MAX_FRAMELEN);
   writeRegByte(MAADR5, macaddr[0]);
   writeRegByte(MAADR4, macaddr[1]);
@@ -487,13 +701,22 @@ byte ENC28J60::initialize(uint16_t size, const byte* macaddr, byte CS) {
   writeRegByte(MAADR2, macaddr[3]);
   writeRegByte(MAADR1, macaddr[4]);
   writeRegByte(MAADR0, macaddr[5]);
+  phyScan = false;  // stopped by the reset
+  // the reset value of PDPXMD depends on the LEDB wiring, so always set it
+  writePhy(PHCON1, fullDuplex ? PHCON1_PDPXMD : 0);
   writePhy(PHCON2, PHCON2_HDLDIS);
+  // report link changes through EIR.LINKIF; isLinkUp() then needs no PHY access
+  writePhy(PHIE, PHIE_PGEIE | PHIE_PLNKIE);
+  readPhyByte(PHIR);
+  linkUp = (readPhyByte(PHSTAT2) >> 2) & 1;
   SetBank(ECON1);
-  writeOp(ENC28J60_BIT_FIELD_SET, EIE, EIE_INTIE | EIE_PKTIE);
+  writeOp(ENC28J60_BIT_FIELD_SET, EIE, EIE_INTIE | EIE_PKTIE | EIE_LINKIE);
   writeOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_RXEN);
 
   //LOG(LL_INFO, ("before read reg byte"));
   byte rev = readRegByte(EREVID) & 0x1F;
+  chipRevision = rev;
+  setSpiClock(clock);
   //LOG(LL_INFO, ("rev %d ", rev));
   // microchip forgot to step the number on the silcon when they
   // released the revision B7. 6 is now rev B7. We still have
@@ -526,25 +749,493 @@ byte ENC28J60::initialize(uint16_t size, const byte* macaddr, byte CS) {
   return rev;
 }
 
+// Picks up a link change, at most every LINK_POLL_INTERVAL unless INT fired;
+// reading PHIR clears LINKIF and releases INT
+static void serviceLink() {
+  if (!events->linkEvent && millis() - lastLinkPoll < LINK_POLL_INTERVAL)
+    return;
+  events->linkEvent = false;
+  lastLinkPoll = millis();
+  if (!(readRegByte(EIR) & EIR_LINKIF))
+    return;
+  readPhyByte(PHIR);
+  bool up = phyScan ? (readRegByte(MIRD + 1) >> 2) & 1 : (readPhyByte(PHSTAT2) >> 2) & 1;
+  if (up != linkUp) {
+    linkUp = up;
+    if (linkCallback)
+      linkCallback(up);
+  }
+}
+
+bool ENC28J60::isFullDuplex() {
+  return fullDuplex;
+}
+
+void ENC28J60::enablePhyScan() {
+  if (phyScan)
+    return;
+  phyScan = true;
+  startPhyScan();
+}
+
+void ENC28J60::disablePhyScan() {
+  pausePhyScan();
+  phyScan = false;
+}
+
+uint16_t ENC28J60::getPhyStatus() {
+  if (phyScan)
+    return readRegByte(MIRD + 1) << 8;  // link and duplex, a single register read
+  return readPhy(PHSTAT2);
+}
+
 bool ENC28J60::isLinkUp() {
-  return (readPhyByte(PHSTAT2) >> 2) & 1;
-//  return (readPhyByte(PHSTAT1) >> 2) & 1;
+  serviceLink();
+  return linkUp;
+}
+
+void ENC28J60::setLinkCallback(LinkCallback callback) {
+  linkCallback = callback;
+}
+
+#ifndef IRAM_ATTR
+#define IRAM_ATTR
+#endif
+
+#define NO_INT_PIN 0xFF
+#define NO_INT_LINE 0xFF
+#define INT_LINES 3  // controllers that can use their INT line at the same time
+#define INT_FALLBACK_POLL 100  // ms; the errata warn that PKTIF is not fully reliable
+
+static byte intPin = NO_INT_PIN;
+static byte intLine = NO_INT_LINE;
+static uint32_t lastPoll;
+static bool asyncSend = false;
+
+// TX interrupts are only useful when packetSend() does not wait itself
+static void updateTxInterrupt() {
+  if (asyncSend && intPin != NO_INT_PIN)
+    writeOp(ENC28J60_BIT_FIELD_SET, EIE, EIE_TXIE | EIE_TXERIE);
+  else
+    writeOp(ENC28J60_BIT_FIELD_CLR, EIE, EIE_TXIE | EIE_TXERIE);
+}
+
+// One handler per INT line, so an interrupt only flags the controller it came from
+static struct {
+  ENC28J60Events* events;  // NULL while the line is free
+  void (*callback)();
+} intLines[INT_LINES];
+
+static void IRAM_ATTR intLineFired(byte line) {
+  ENC28J60Events* flags = intLines[line].events;
+  flags->rxPending = true;
+  flags->txEvent = true;
+  flags->linkEvent = true;
+  if (intLines[line].callback)
+    intLines[line].callback();
+}
+
+static void IRAM_ATTR encInterrupt0() {
+  intLineFired(0);
+}
+
+static void IRAM_ATTR encInterrupt1() {
+  intLineFired(1);
+}
+
+static void IRAM_ATTR encInterrupt2() {
+  intLineFired(2);
+}
+
+static void (*const intHandlers[INT_LINES])() = { encInterrupt0, encInterrupt1, encInterrupt2 };
+
+void ENC28J60::enableInterrupt(uint8_t pin, void (*callback)()) {
+  disableInterrupt();
+  byte line = 0;
+  while (line < INT_LINES && intLines[line].events)
+    ++line;
+  if (line == INT_LINES)
+    return;  // all lines taken, keep polling
+  intLines[line].events = events;
+  intLines[line].callback = callback;
+  intLine = line;
+  intPin = pin;
+  pinMode(intPin, INPUT_PULLUP);
+  events->rxPending = true;  // pick up anything received before the handler was attached
+  attachInterrupt(digitalPinToInterrupt(intPin), intHandlers[line], FALLING);
+  updateTxInterrupt();
+}
+
+void ENC28J60::disableInterrupt() {
+  if (intPin != NO_INT_PIN) {
+    detachInterrupt(digitalPinToInterrupt(intPin));
+    intLines[intLine].events = NULL;
+    intLines[intLine].callback = NULL;
+  }
+  intPin = NO_INT_PIN;
+  intLine = NO_INT_LINE;
+  updateTxInterrupt();
+}
+
+bool ENC28J60::isPacketPending() {
+  if (intPin == NO_INT_PIN || events->rxPending || digitalRead(intPin) == LOW)
+    return true;
+  if (millis() - lastPoll >= INT_FALLBACK_POLL) {
+    lastPoll = millis();
+    return true;
+  }
+  return false;
 }
 
 struct transmit_status_vector {
   uint8_t bytes[7];
 };
 
-#if ETHERCARD_SEND_PIPELINING
-#define BREAKORCONTINUE \
-  retry = 0; \
-  continue;
+static bool txPending;   // a frame was started and its result not yet collected
+static byte txRetry;     // late collision retries of the pending frame
+static TransmitCallback txCallback = NULL;
+
+static void startTransmission() {
+  // latest errata sheet: DS80349C
+  // always reset transmit logic (Errata Issue 12)
+  // the Microchip TCP/IP stack implementation used to first check
+  // whether TXERIF is set and only then reset the transmit logic
+  // but this has been changed in later versions; possibly they
+  // have a reason for this; they don't mention this in the errata
+  // sheet
+  writeOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_TXRST);
+  writeOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_TXRST);
+  writeOp(ENC28J60_BIT_FIELD_CLR, EIR, EIR_TXERIF | EIR_TXIF);
+
+  // initiate transmission
+  writeOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_TXRTS);
+  txPending = true;
+}
+
+static void finishTransmission(bool success) {
+  txPending = false;
+  if (!success)
+    NETSTAT_INC(txErrors);
+  if (asyncSend && intPin != NO_INT_PIN)
+    writeOp(ENC28J60_BIT_FIELD_CLR, EIR, EIR_TXERIF | EIR_TXIF);  // release INT
+  if (txCallback)
+    txCallback(success);
+}
+
+// Collects the result of the frame started last without waiting. ETXST/ETXND
+// still describe that frame, so a retry only has to restart the transmission.
+// With abort set a frame that has not finished yet is given up.
+static bool transmissionDone(bool abort) {
+  if (!txPending)
+    return true;
+
+  byte eir = readRegByte(EIR);
+  if ((eir & (EIR_TXIF | EIR_TXERIF)) == 0 && !abort)
+    return false;
+  if (!(eir & EIR_TXERIF) && (eir & EIR_TXIF)) {
+    // no error
+    finishTransmission(true);
+    return true;
+  }
+
+  // cancel previous transmission if stuck
+  writeOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_TXRTS);
+
+#if ETHERCARD_RETRY_LATECOLLISIONS
+  // no collisions in full duplex
+  if (fullDuplex) {
+    finishTransmission(false);
+    return true;
+  }
+
+  // Check whether the chip thinks that a late collision ocurred; the chip
+  // may be wrong (Errata Issue 13); therefore we retry. We could check
+  // LATECOL in the ESTAT register in order to find out whether the chip
+  // thinks a late collision ocurred but (Errata Issue 15) tells us that
+  // this is not working. Therefore we check TSV
+  transmit_status_vector tsv;
+  uint16_t etxnd = readReg(ETXND);
+  writeReg(ERDPT, etxnd + 1);
+  readBuf(sizeof(transmit_status_vector), (byte*)&tsv);
+  // LATECOL is bit number 29 in TSV (starting from 0)
+
+  if ((eir & EIR_TXERIF) && (tsv.bytes[3] & 1 << 5) /*tsv.transmitLateCollision*/ && txRetry <= 16U) {
+    txRetry++;
+    NETSTAT_INC(txRetries);
+    startTransmission();
+    return false;
+  }
+#endif
+
+  finishTransmission(false);
+  return true;
+}
+
+static void completeTransmission() {
+  // wait until transmission has finished; referrring to the data sheet and
+  // to the errata (Errata Issue 13; Example 1) you only need to wait until either
+  // TXIF or TXERIF gets set; however this leads to hangs; apparently Microchip
+  // realized this and in later implementations of their tcp/ip stack they introduced
+  // a counter to avoid hangs; of course they didn't update the errata sheet
+  uint16_t count = 0;
+  while (!transmissionDone(count == 1000U))
+    count = count < 1000U ? count + 1 : 0;  // start over after a retry
+}
+
+void ENC28J60::setAsyncSend(bool enable, TransmitCallback callback) {
+  completeTransmission();
+  asyncSend = enable;
+  txCallback = callback;
+  updateTxInterrupt();
+}
+
+bool ENC28J60::isTxBusy() {
+  if (!txPending)
+    return false;
+  // with TX interrupts enabled there is nothing to ask the chip until INT fires
+  if (asyncSend && intPin != NO_INT_PIN && !events->txEvent && digitalRead(intPin) == HIGH)
+    return true;
+  events->txEvent = false;
+  return !transmissionDone(false);
+}
+
+struct checksum_job {
+  uint16_t dest;  // offset of the checksum field in the frame
+  uint16_t off;   // first byte summed up
+  uint16_t len;   // number of bytes summed up
+};
+
+static bool checksumOffload = false;
+static checksum_job checksumJobs[ENC28J60_CHECKSUM_JOBS];
+static byte checksumJobCount;
+static uint16_t txPayloadOffset;  // frame bytes taken from the buffer, 0 without a payload
+static uint16_t txPayloadPos;     // where the next payload byte goes
+static bool txPayloadUnsummed;    // a checksum over the payload could not be queued
+
+static bool waitForClear(byte address, byte mask);
+
+void ENC28J60::setChecksumOffload(bool enable) {
+  checksumOffload = enable;
+  checksumJobCount = 0;
+}
+
+bool ENC28J60::isChecksumOffload() {
+  return checksumOffload;
+}
+
+bool ENC28J60::queueChecksum(uint16_t dest, uint16_t off, uint16_t len) {
+  byte i = 0;
+  while (i < checksumJobCount && checksumJobs[i].dest != dest)
+    ++i;
+  if (!checksumOffload || i == ENC28J60_CHECKSUM_JOBS) {
+    // the host cannot sum up a payload that is only in the TX buffer
+    if (txPayloadOffset && off + len > txPayloadOffset)
+      txPayloadUnsummed = true;
+    return false;
+  }
+  if (i == checksumJobCount)
+    ++checksumJobCount;
+  checksumJobs[i].dest = dest;
+  checksumJobs[i].off = off;
+  checksumJobs[i].len = len;
+  return true;
+}
+
+
+void ENC28J60::txPayloadBegin(uint16_t offset) {
+  // the only slot may still be on the wire (pipelining)
+  if (txSlots == 1)
+    completeTransmission();
+  txPayloadOffset = offset;
+  txPayloadUnsummed = false;
+  txPayloadPos = txStart + txSlot * TX_SLOT_SIZE + 1 + offset + (tagging_enabled ? 4 : 0);
+}
+
+void ENC28J60::txPayloadWrite(const void* data, uint16_t len) {
+  writeReg(EWRPT, txPayloadPos);
+  writeBuf(len, (const byte*)data);
+  txPayloadPos += len;
+}
+
+void ENC28J60::txPayloadCopy(byte page, byte off, byte len) {
+  uint16_t source = scratchStart + (page << SCRATCH_PAGE_SHIFT) + off;
+  if (len == 0 || source < scratchStart || source + len > scratchLimit)
+    return;
+  writeReg(EDMAST, source);
+  writeReg(EDMAND, source + len - 1);
+  writeReg(EDMADST, txPayloadPos);
+  writeOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_CSUMEN);
+  writeOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_DMAST);
+  if (!waitForClear(ECON1, ECON1_DMAST)) {
+    // copy through the host instead
+    byte tmp[SCRATCH_PAGE_SIZE];
+    writeOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_DMAST);
+    writeReg(ERDPT, source);
+    readBuf(len, tmp);
+    writeReg(EWRPT, txPayloadPos);
+    writeBuf(len, tmp);
+  }
+  txPayloadPos += len;
+}
+
+static uint32_t sumWords(const byte* ptr, uint16_t len, uint32_t sum) {
+  for (; len > 1; len -= 2, ptr += 2)
+    sum += (uint16_t)(((uint32_t)*ptr << 8) | *(ptr + 1));
+  if (len)
+    sum += ((uint32_t)*ptr) << 8;
+  return sum;
+}
+
+// Runs the queued checksums over the frame written to the TX buffer at addr
+// (control byte excluded) and patches the results in. The checksum fields hold
+// the part of the pseudo header not covered by the range, so the DMA result is
+// final. If the DMA engine does not finish, the range is summed up on the host:
+// from the host copy if it is in there, else read back from the TX buffer.
+// Unlike the TX buffer the host copy has no VLAN tag, which moves the ranges
+// by shift bytes.
+static void applyChecksums(uint16_t addr, const byte* frame, uint16_t frameLen, byte shift) {
+  for (byte i = 0; i < checksumJobCount; ++i) {
+    const checksum_job& job = checksumJobs[i];
+    uint16_t first = addr + job.off + shift;
+    uint16_t ck;
+    writeReg(EDMAST, first);
+    writeReg(EDMAND, first + job.len - 1);
+    writeOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_DMAST | ECON1_CSUMEN);
+    if (waitForClear(ECON1, ECON1_DMAST)) {
+      ck = readReg(EDMACS);
+    } else {
+      writeOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_DMAST);
+      uint32_t sum = 0;
+      if (job.off + job.len <= frameLen) {
+        sum = sumWords(frame + job.off, job.len, 0);
+      } else {
+        byte tmp[32];  // even, so no word straddles two reads
+        writeReg(ERDPT, first);
+        for (uint16_t done = 0; done < job.len; done += sizeof tmp) {
+          uint16_t n = job.len - done;
+          if (n > sizeof tmp)
+            n = sizeof tmp;
+          readBuf(n, tmp);
+          sum = sumWords(tmp, n, sum);
+        }
+      }
+      while (sum >> 16)
+        sum = (uint16_t)sum + (sum >> 16);
+      ck = ~(uint16_t)sum;
+    }
+    byte field[2] = { (byte)(ck >> 8), (byte)ck };  // EDMACSH first
+    writeReg(EWRPT, addr + job.dest + shift);
+    writeBuf(sizeof field, field);
+  }
+  checksumJobCount = 0;
+}
+
+#if ETHERCARD_CAPTURE
+// Ring of fixed size slots, each a CaptureRecord followed by snaplen bytes
+static byte* captureRing = NULL;
+static uint16_t captureSlots;
+static uint16_t captureSlotSize;
+static uint16_t captureSnaplen;
+static uint16_t captureHead;   // slot written next
+static uint16_t captureCount;  // slots not read yet
+static uint32_t captureLostCount;
+static bool capturePaused;
+static CaptureFilter captureFilter;
+static bool captureFilterIp;
+
+bool ENC28J60::setCapture(byte* ring, uint32_t size, uint16_t snaplen, const CaptureFilter* filter) {
+  captureRing = NULL;
+  uint16_t slotSize = (sizeof(CaptureRecord) + snaplen + 3) & ~3;  // keeps the records aligned
+  if (ring == NULL || snaplen == 0 || size < slotSize)
+    return ring == NULL;
+  captureSlots = size / slotSize > 0xFFFF ? 0xFFFF : size / slotSize;
+  captureSlotSize = slotSize;
+  captureSnaplen = snaplen;
+  captureHead = 0;
+  captureCount = 0;
+  captureLostCount = 0;
+  capturePaused = false;
+  if (filter)
+    captureFilter = *filter;
+  else
+    memset(&captureFilter, 0, sizeof captureFilter);
+  captureFilterIp = captureFilter.ip[0] | captureFilter.ip[1] | captureFilter.ip[2] | captureFilter.ip[3];
+  captureRing = ring;
+  return true;
+}
+
+const byte* ENC28J60::captureNext(CaptureRecord& record, bool remove) {
+  if (captureRing == NULL || captureCount == 0)
+    return NULL;
+  uint16_t tail = captureHead >= captureCount ? captureHead - captureCount : captureHead + captureSlots - captureCount;
+  const byte* slot = captureRing + (uint32_t)tail * captureSlotSize;
+  memcpy(&record, slot, sizeof record);
+  if (remove)
+    --captureCount;
+  return slot + sizeof(CaptureRecord);
+}
+
+void ENC28J60::pauseCapture(bool pause) {
+  capturePaused = pause;
+}
+
+uint32_t ENC28J60::captureLost() {
+  return captureLostCount;
+}
+
+// Applies the capture filter to the first avail bytes of a frame
+static bool captureMatches(const byte* frame, uint16_t avail) {
+  if (avail < 14)
+    return false;
+  uint16_t eth = 14;
+  uint16_t type = frame[12] << 8 | frame[13];
+  if (type == 0x8100 && avail >= 18) {
+    type = frame[16] << 8 | frame[17];
+    eth = 18;
+  }
+  if (captureFilter.etherType && type != captureFilter.etherType)
+    return false;
+  if (!captureFilterIp && !captureFilter.port)
+    return true;
+  if (type != 0x0800 || avail < eth + 20)
+    return false;
+  const byte* ip = frame + eth;
+  if (captureFilterIp && memcmp(ip + 12, captureFilter.ip, 4) && memcmp(ip + 16, captureFilter.ip, 4))
+    return false;
+  if (!captureFilter.port)
+    return true;
+  uint16_t hlen = (ip[0] & 0x0f) << 2;
+  if ((ip[9] != 6 && ip[9] != 17) || (ip[6] & 0x1f) || ip[7] || avail < eth + hlen + 4)
+    return false;  // not UDP or TCP, or a fragment without the ports
+  const byte* ports = ip + hlen;
+  return (ports[0] << 8 | ports[1]) == captureFilter.port || (ports[2] << 8 | ports[3]) == captureFilter.port;
+}
+
+// Records a frame of len bytes, of which avail are in the host buffer
+static void captureFrame(const byte* frame, uint16_t len, uint16_t avail, bool tx) {
+  if (captureRing == NULL || capturePaused || !captureMatches(frame, avail))
+    return;
+  byte* slot = captureRing + (uint32_t)captureHead * captureSlotSize;
+  CaptureRecord* record = (CaptureRecord*)slot;
+  record->timestamp = micros();
+  record->len = len;
+  record->capLen = avail < captureSnaplen ? avail : captureSnaplen;
+  record->tx = tx;
+  memcpy(slot + sizeof(CaptureRecord), frame, record->capLen);
+  if (++captureHead == captureSlots)
+    captureHead = 0;
+  if (captureCount < captureSlots)
+    ++captureCount;
+  else
+    ++captureLostCount;  // overwrote the oldest
+}
 #else
-#define BREAKORCONTINUE break;
+#define captureFrame(frame, len, avail, tx)
 #endif
 
 void ENC28J60::packetSend(uint16_t len) {
-  byte retry = 0;
+  byte shift = 0;  // VLAN tag inserted in front of the checksummed ranges
+  uint16_t hostLen = txPayloadOffset ? txPayloadOffset : len;
 
   // Check if packet to send is big enough (usually should be) and if VLAN tagging is
   // enabled.
@@ -557,163 +1248,368 @@ void ENC28J60::packetSend(uint16_t len) {
   //    Drop eligible indicator (DEI)
   //        A 1-bit field. (formerly CFI[c]) May be used separately or in conjunction with
   //        PCP to indicate frames eligible to be dropped in the presence of congestion.
+  byte tag[4];
   if ((len > 16) && (tagging_enabled)) {
-    // Move data for inserting 802.1Q header
-    memmove(&buffer[16], &buffer[12], len - 4);
+    // 802.1Q header, written between the MAC addresses and the EtherType below
+    tag[0] = 0x81;  // High byte of EtherType
+    tag[1] = 0x00;  // Low byte
+    tag[2] = ((vlan_TCI_PCP & 0x07) << 5) | ((vlan_TCI_DEI & 0x01) << 4) | ((vlanID >> 8) & 0x0f);
+    tag[3] = vlanID & 0xff;
     len += 4;
-    buffer[12] = 0x81;  // High byte of EtherType
-    buffer[13] = 0x00;  // Low byte
-    buffer[14] = ((vlan_TCI_PCP & 0x04) << 5) | ((vlan_TCI_DEI & 0x01 )<< 4 ) | ((vlanID >> 8) & 0x0f);
-    buffer[15] = vlanID & 0xff;
-  }
-
-
-  // #if ETHERCARD_SEND_PIPELINING
-  // goto resume_last_transmission;
-  // #endif
-  while (1) {
-    // latest errata sheet: DS80349C
-    // always reset transmit logic (Errata Issue 12)
-    // the Microchip TCP/IP stack implementation used to first check
-    // whether TXERIF is set and only then reset the transmit logic
-    // but this has been changed in later versions; possibly they
-    // have a reason for this; they don't mention this in the errata
-    // sheet
-    writeOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_TXRST);
-    writeOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_TXRST);
-    writeOp(ENC28J60_BIT_FIELD_CLR, EIR, EIR_TXERIF | EIR_TXIF);
-
-    // prepare new transmission
-    if (retry == 0) {
-      writeReg(EWRPT, TXSTART_INIT);
-      writeReg(ETXND, TXSTART_INIT + len);
-      writeOp(ENC28J60_WRITE_BUF_MEM, 0, 0x00);
-      writeBuf(len, buffer);
-    }
+    shift = 4;
+  }
 
-    // initiate transmission
-    writeOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_TXRTS);
-#if ETHERCARD_SEND_PIPELINING
-    if (retry == 0) return;
+  if (txPayloadUnsummed) {
+    // sending it would put a wrong checksum on the wire
+    txPayloadOffset = 0;
+    txPayloadUnsummed = false;
+    checksumJobCount = 0;
+    NETSTAT_INC(txErrors);
+    if (txCallback)
+      txCallback(false);
+    return;
+  }
+
+  uint16_t start = txStart + txSlot * TX_SLOT_SIZE;
+  // the only slot may still be on the wire (pipelining)
+  if (txSlots == 1)
+    completeTransmission();
+
+  // copy the frame while the previous one (in another slot) is being sent;
+  // the write pointer moves on by itself, so the tag costs two extra bursts
+  // instead of moving the frame in the buffer
+  writeReg(EWRPT, start);
+  writeOp(ENC28J60_WRITE_BUF_MEM, 0, 0x00);
+  if (shift) {
+    writeBuf(12, buffer);
+    writeBuf(sizeof tag, tag);
+    writeBuf(hostLen - 12, buffer + 12);
+  } else
+    writeBuf(hostLen, buffer);
+  txPayloadOffset = 0;
+  if (checksumJobCount)
+    applyChecksums(start + 1, buffer, hostLen, shift);
+
+  completeTransmission();
+  writeReg(ETXST, start);
+  writeReg(ETXND, start + len);
+  txRetry = 0;
+  startTransmission();
+  NETSTAT_INC(txFrames);
+  captureFrame(buffer, len - shift, hostLen, true);
+  txSlot = (txSlot + 1) % txSlots;
+
+#if !ETHERCARD_SEND_PIPELINING
+  if (txSlots == 1 && !asyncSend)
+    completeTransmission();
 #endif
+}
 
-    // resume_last_transmission:
 
-    // wait until transmission has finished; referrring to the data sheet and
-    // to the errata (Errata Issue 13; Example 1) you only need to wait until either
-    // TXIF or TXERIF gets set; however this leads to hangs; apparently Microchip
-    // realized this and in later implementations of their tcp/ip stack they introduced
-    // a counter to avoid hangs; of course they didn't update the errata sheet
-    uint16_t count = 0;
-    while ((readRegByte(EIR) & (EIR_TXIF | EIR_TXERIF)) == 0 && ++count < 1000U)
-      ;
+static PacketFilterCallback packetFilter = NULL;
 
-    if (!(readRegByte(EIR) & EIR_TXERIF) && count < 1000U) {
-      // no error; start new transmission
-      BREAKORCONTINUE
-    }
+void ENC28J60::setPacketFilter(PacketFilterCallback filter) {
+  packetFilter = filter;
+}
 
-    // cancel previous transmission if stuck
-    writeOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_TXRTS);
+// Hands the space up to the frame read last back to the receive hardware.
+// ERXRDPT has to be odd (Rev. B7 errata 14), hence next - 1.
+static void releasePackets() {
+  if (gNextPacketPtr == 0)
+    writeReg(ERXRDPT, rxStop);
+  else
+    writeReg(ERXRDPT, gNextPacketPtr - 1);
+  unreleasedPacket = false;
+}
 
-#if ETHERCARD_RETRY_LATECOLLISIONS == 0
-    BREAKORCONTINUE
-#endif
+static bool checksumVerify = false;
 
-    // Check whether the chip thinks that a late collision ocurred; the chip
-    // may be wrong (Errata Issue 13); therefore we retry. We could check
-    // LATECOL in the ESTAT register in order to find out whether the chip
-    // thinks a late collision ocurred but (Errata Issue 15) tells us that
-    // this is not working. Therefore we check TSV
-    transmit_status_vector tsv;
-    uint16_t etxnd = readReg(ETXND);
-    writeReg(ERDPT, etxnd + 1);
-    readBuf(sizeof(transmit_status_vector), (byte*)&tsv);
-    // LATECOL is bit number 29 in TSV (starting from 0)
-
-    if (!((readRegByte(EIR) & EIR_TXERIF) && (tsv.bytes[3] & 1 << 5) /*tsv.transmitLateCollision*/) || retry > 16U) {
-      // there was some error but no LATECOL so we do not repeat
-      BREAKORCONTINUE
-    }
+void ENC28J60::setChecksumVerify(bool enable) {
+  checksumVerify = enable;
+}
 
-    retry++;
-  }
+uint32_t ENC28J60::getChecksumErrors() {
+  return stats.rxBadChecksum;
+}
+
+// Sums up count bytes of the RX ring starting at first; the DMA engine wraps
+// around at the end of the ring by itself
+static bool ringChecksum(uint16_t first, uint16_t count, uint16_t& ck) {
+  uint16_t last = first + count - 1;
+  if (first > rxStop)
+    first -= rxStop + 1 - RXSTART_INIT;
+  if (last > rxStop)
+    last -= rxStop + 1 - RXSTART_INIT;
+  writeReg(EDMAST, first);
+  writeReg(EDMAND, last);
+  writeOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_DMAST | ECON1_CSUMEN);
+  if (!waitForClear(ECON1, ECON1_DMAST))
+    return false;
+  ck = readReg(EDMACS);
+  return true;
 }
 
+// Checks the IPv4 header checksum and the UDP, TCP or ICMP checksum of a frame
+// still in the RX ring at addr, using the host copy only to find the headers.
+// For a frame with our VLAN tag addr is moved on by the tag, which the host
+// copy lacks. Frames that are not IPv4, malformed or fragmented are left to
+// the stack.
+static bool checksumsValid(uint16_t addr, const byte* data, uint16_t len) {
+  const uint16_t eth = 14;
+  if (len < eth + 20 || data[eth - 2] != 0x08 || data[eth - 1] != 0x00)
+    return true;
+  const byte* ip = data + eth;
+  uint16_t hlen = (ip[0] & 0x0f) << 2;
+  uint16_t total = ip[2] << 8 | ip[3];
+  if ((ip[0] >> 4) != 4 || hlen < 20 || total < hlen || eth + total > len)
+    return true;
+
+  uint16_t ck;
+  if (ringChecksum(addr + eth, hlen, ck) && ck != 0)
+    return false;
+  if ((ip[6] & 0x3f) || ip[7])
+    return true;  // the upper layer checksum covers the whole datagram
+
+  uint16_t plen = total - hlen;
+  uint16_t first, count, seed;
+  switch (ip[9]) {
+    case 17:  // UDP, checksum over source and destination address and the datagram
+      if (plen < 8 || (ip[hlen + 6] == 0 && ip[hlen + 7] == 0))
+        return true;  // no checksum sent
+      first = 12;
+      count = 8 + plen;
+      seed = 17 + plen;
+      break;
+    case 6:  // TCP, likewise
+      if (plen < 20)
+        return true;
+      first = 12;
+      count = 8 + plen;
+      seed = 6 + plen;
+      break;
+    case 1:  // ICMP
+      if (plen < 8)
+        return true;
+      first = hlen;
+      count = plen;
+      seed = 0;
+      break;
+    default:
+      return true;
+  }
+  if (!ringChecksum(addr + eth + first, count, ck))
+    return true;
+  // add the rest of the pseudo header to the sum the chip returned inverted
+  uint32_t sum = (uint16_t)~ck + (uint32_t)seed;
+  while (sum >> 16)
+    sum = (uint16_t)sum + (sum >> 16);
+  return sum == 0xFFFF;
+}
 
-uint16_t ENC28J60::packetReceive() {
-  static uint16_t gNextPacketPtr = RXSTART_INIT;
-  static bool unreleasedPacket = false;
-  uint16_t len = 0;
+// Checks the 802.1Q header of a tagged frame: takes the priority of frames
+// for our VLAN and rejects other VLANs
+static bool vlanAccept(const byte* data) {
+  uint16_t rec_vlanID = (data[14] << 8 | data[15]) & 0x0fff;  // 12 bit VLAN ID
+  if ((rec_vlanID != ENC28J60::vlanID) || (!ENC28J60::tagging_enabled))
+    return false;
+  ENC28J60::vlan_TCI_PCP = data[14] >> 5;
+  ENC28J60::vlan_TCI_DEI = (data[14] >> 4) & 0x01;
+  return true;
+}
 
-  if (unreleasedPacket) {
-    if (gNextPacketPtr == 0)
-      writeReg(ERXRDPT, RXSTOP_INIT);
-    else
-      writeReg(ERXRDPT, gNextPacketPtr - 1);
-    unreleasedPacket = false;
+// Copies the frame at gNextPacketPtr into data (at most size - 1 bytes,
+// 0-terminated, our VLAN tag stripped) and decrements EPKTCNT. Returns 0 for
+// frames received with errors or rejected by a filter.
+static uint16_t readPacket(byte* data, uint16_t size, PacketFilterCallback filter, bool& tagged) {
+  // the frame follows the next packet pointer and the 4 byte status vector
+  uint16_t frame = gNextPacketPtr + 6;
+  writeReg(ERDPT, gNextPacketPtr);
+
+  struct {
+    uint16_t nextPacket;
+    uint16_t byteCount;
+    uint16_t status;
+  } header;
+
+  readBuf(sizeof header, (byte*)&header);
+
+  gNextPacketPtr = header.nextPacket;
+  uint16_t len = header.byteCount - 4;  //remove the CRC count
+  uint16_t got = 0;                     // bytes of the frame already in data
+  tagged = false;
+  NETSTAT_INC(rxFrames);
+  if ((header.status & 0x80) == 0) {
+    NETSTAT_DROP(rxBadLength);
+    len = 0;
+  } else if (size <= 16) {
+    NETSTAT_DROP(rxBadLength);  // no room to check the VLAN tag
+    len = 0;
+  } else if (len > 16) {
+    readBuf(16, data);
+    got = 16;
+    if (data[12] == 0x81 && data[13] == 0x00) {
+      if (vlanAccept(data)) {
+        // the rest of the frame is read over the tag, which strips it
+        tagged = true;
+        len -= 4;
+        frame += 4;
+        got = 12;
+      } else {
+        NETSTAT_DROP(rxVlanMismatch);
+        len = 0;
+      }
+    }
   }
+  uint16_t frameLen = len;
+  bool clipped = len > size - 1;
+  if (clipped)
+    len = size - 1;
+  if (filter && len > ENC28J60_PEEK_LEN) {
+    readBuf(ENC28J60_PEEK_LEN - got, data + got);
+    if (filter(len))
+      readBuf(len - ENC28J60_PEEK_LEN, data + ENC28J60_PEEK_LEN);
+    else {
+      NETSTAT_DROP(rxNotForUs);
+      len = 0;
+    }
+  } else if (len > got)
+    readBuf(len - got, data + got);
+  if (checksumVerify && len && !clipped && !checksumsValid(frame, data, len)) {
+    ++ENC28J60::stats.rxBadChecksum;
+    NETSTAT_INC(rxDropped);
+    len = 0;
+  }
+  if (len)
+    captureFrame(data, frameLen, len, false);
+  data[len] = 0;
+
+  writeOp(ENC28J60_BIT_FIELD_SET, ECON2, ECON2_PKTDEC);
+  return len;
+}
 
-  if (readRegByte(EPKTCNT) > 0) {
-    writeReg(ERDPT, gNextPacketPtr);
+void ENC28J60::getStats(NetStats& snapshot, bool reset) {
+  snapshot = stats;
+  if (reset)
+    resetStats();
+}
 
-    struct {
-      uint16_t nextPacket;
-      uint16_t byteCount;
-      uint16_t status;
-    } header;
+void ENC28J60::resetStats() {
+  memset(&stats, 0, sizeof stats);
+}
 
-    readBuf(sizeof header, (byte*)&header);
+void ENC28J60::setFlowControl(bool enable) {
+  if (!enable && backpressure && fullDuplex)
+    writeRegByte(EFLOCON, EFLOCON_FCEN1 | EFLOCON_FCEN0);
+  flowControl = enable;
+  backpressure = false;
+}
 
-    gNextPacketPtr = header.nextPacket;
-    len = header.byteCount - 4;  //remove the CRC count
-    if (len > bufferSize - 1)
-      len = bufferSize - 1;
-    if ((header.status & 0x80) == 0)
-      len = 0;
-    else
-      readBuf(len, buffer);
-    buffer[len] = 0;
-    unreleasedPacket = true;
+bool ENC28J60::isBackpressure() {
+  return backpressure;
+}
+
+uint32_t ENC28J60::getRxOverflows() {
+  return stats.rxOverflows;
+}
+
+// Called with the number of frames waiting in the RX ring. Counts overflows
+// and, above the high water mark, tells the sender to pause: in full duplex
+// the chip repeats PAUSE frames with EPAUS until a zero time PAUSE frame
+// is sent below the low water mark.
+static void checkRxRing(uint8_t waiting) {
+  if (waiting > 0 && (readRegByte(EIR) & EIR_RXERIF)) {
+    ++ENC28J60::stats.rxOverflows;
+    writeOp(ENC28J60_BIT_FIELD_CLR, EIR, EIR_RXERIF);
+  }
+  if (!flowControl)
+    return;
 
-    writeOp(ENC28J60_BIT_FIELD_SET, ECON2, ECON2_PKTDEC);
+  uint16_t ringSize = rxStop + 1 - RXSTART_INIT;
+  uint16_t fill = 0;
+  if (waiting > 0)
+    fill = (readReg(ERXWRPT) + ringSize - gNextPacketPtr) % ringSize;
+  if (!backpressure && fill >= (uint32_t)ringSize * ENC28J60_RX_HIGH_WATER / 100) {
+    backpressure = true;
+    if (fullDuplex)
+      writeRegByte(EFLOCON, EFLOCON_FCEN1);
+  } else if (backpressure && fill <= (uint32_t)ringSize * ENC28J60_RX_LOW_WATER / 100) {
+    backpressure = false;
+    if (fullDuplex)
+      writeRegByte(EFLOCON, EFLOCON_FCEN1 | EFLOCON_FCEN0);
   }
+}
+
+// Housekeeping shared by packetReceive() and packetReceiveBatch()
+static void prepareReceive() {
+  // reports asynchronous transmissions and retries late collisions
+  if (txPending)
+    ENC28J60::isTxBusy();
+  serviceLink();
+
+  // the buffer is about to be reused, drop what was never sent
+  checksumJobCount = 0;
+  txPayloadOffset = 0;
+  txPayloadUnsummed = false;
+
+  if (unreleasedPacket)
+    releasePackets();
+}
 
-  // VLAN check
+uint16_t ENC28J60::packetReceive() {
+  uint16_t len = 0;
   received_tagged = false;
-  if (len > 16) {
-    uint16_t ethType = buffer[12] << 8 | buffer[13];  // get EtherType
-    if (ethType == 0x8100) {
-      // tagged Ethernet frame
-      uint16_t rec_vlanID = (buffer[14] << 8 | buffer[15]) & 0x0fff;  // 12 bit VLAN ID
-      if ((rec_vlanID == vlanID) && (tagging_enabled)) {
-		vlan_TCI_PCP = (buffer[14] > 5 ) & 0x04;
-		vlan_TCI_DEI = (buffer[14] > 4 ) & 0x01;
-        memmove(&buffer[12], &buffer[16], len - 4);
-        memset(&buffer[len - 4], 0, 4);
-        len -= 4;
-        received_tagged = true;
-      } else {
-        memset(&buffer[0], 0, len - 1);
-        len = 0;
-      }
+  prepareReceive();
+
+  bool pending = isPacketPending();
+  events->rxPending = false;  // INT stays asserted while packets are left, so a lost edge is harmless
+  if (pending) {
+    uint8_t waiting = readRegByte(EPKTCNT);
+    checkRxRing(waiting);
+    if (waiting > 0) {
+      len = readPacket(buffer, bufferSize, packetFilter, received_tagged);
+      unreleasedPacket = true;
     }
   }
 
   return len;
 }
 
+uint8_t ENC28J60::packetReceiveBatch(PacketDescriptor* ring, uint8_t count) {
+  prepareReceive();
+
+  bool pending = isPacketPending();
+  events->rxPending = false;
+  if (!pending || count == 0)
+    return 0;
+
+  uint8_t waiting = readRegByte(EPKTCNT);
+  checkRxRing(waiting);
+  uint8_t n = 0;
+  // a descriptor too small for the VLAN check ends the batch, the frame stays in the ring
+  while (waiting > 0 && n < count && ring[n].size > 16) {
+    ring[n].len = readPacket(ring[n].data, ring[n].size, NULL, ring[n].tagged);
+    --waiting;
+    if (ring[n].len > 0)
+      ++n;
+  }
+  // free the whole batch with a single pointer update
+  releasePackets();
+  if (waiting > 0)
+    events->rxPending = true;  // ring full, come back without waiting for INT
+  return n;
+}
+
 void ENC28J60::copyout(byte page, const byte* data) {
-  uint16_t destPos = SCRATCH_START + (page << SCRATCH_PAGE_SHIFT);
-  if (destPos < SCRATCH_START || destPos > SCRATCH_LIMIT - SCRATCH_PAGE_SIZE)
+  uint16_t destPos = scratchStart + (page << SCRATCH_PAGE_SHIFT);
+  if (destPos < scratchStart || destPos > scratchLimit - SCRATCH_PAGE_SIZE)
     return;
   writeReg(EWRPT, destPos);
   writeBuf(SCRATCH_PAGE_SIZE, data);
 }
 
 void ENC28J60::copyin(byte page, byte* data) {
-  uint16_t destPos = SCRATCH_START + (page << SCRATCH_PAGE_SHIFT);
-  if (destPos < SCRATCH_START || destPos > SCRATCH_LIMIT - SCRATCH_PAGE_SIZE)
+  uint16_t destPos = scratchStart + (page << SCRATCH_PAGE_SHIFT);
+  if (destPos < scratchStart || destPos > scratchLimit - SCRATCH_PAGE_SIZE)
     return;
   writeReg(ERDPT, destPos);
   readBuf(SCRATCH_PAGE_SIZE, data);
@@ -721,8 +1617,8 @@ void ENC28J60::copyin(byte page, byte* data) {
 
 byte ENC28J60::peekin(byte page, byte off) {
   byte result = 0;
-  uint16_t destPos = SCRATCH_START + (page << SCRATCH_PAGE_SHIFT) + off;
-  if (SCRATCH_START <= destPos && destPos < SCRATCH_LIMIT) {
+  uint16_t destPos = scratchStart + (page << SCRATCH_PAGE_SHIFT) + off;
+  if (scratchStart <= destPos && destPos < scratchLimit) {
     writeReg(ERDPT, destPos);
     readBuf(1, &result);
   }
@@ -771,7 +1667,7 @@ bool ENC28J60::isPoweredUp() {
 }
 
 void ENC28J60::enableBroadcast(bool temporary) {
-  writeRegByte(ERXFCON, readRegByte(ERXFCON) | ERXFCON_BCEN);
+  updateFilter(ERXFCON_BCEN, 0);
   if (!temporary)
     broadcast_enabled = true;
 }
@@ -780,19 +1676,20 @@ void ENC28J60::disableBroadcast(bool temporary) {
   if (!temporary)
     broadcast_enabled = false;
   if (!broadcast_enabled)
-    writeRegByte(ERXFCON, readRegByte(ERXFCON) & ~ERXFCON_BCEN);
+    updateFilter(0, ERXFCON_BCEN);
 }
 
 void ENC28J60::enableMulticast() {
-  writeRegByte(ERXFCON, readRegByte(ERXFCON) | ERXFCON_MCEN);
+  updateFilter(ERXFCON_MCEN, 0);
 }
 
 void ENC28J60::disableMulticast() {
-  writeRegByte(ERXFCON, readRegByte(ERXFCON) & ~ERXFCON_MCEN);
+  updateFilter(0, ERXFCON_MCEN);
 }
 
 void ENC28J60::enablePromiscuous(bool temporary) {
-  writeRegByte(ERXFCON, readRegByte(ERXFCON) & ERXFCON_CRCEN);
+  filterBypassed = true;
+  writeRegByte(ERXFCON, rxFilter & ERXFCON_CRCEN);
   if (!temporary)
     promiscuous_enabled = true;
 }
@@ -801,30 +1698,121 @@ void ENC28J60::disablePromiscuous(bool temporary) {
   if (!temporary)
     promiscuous_enabled = false;
   if (!promiscuous_enabled) {
-    writeRegByte(ERXFCON, ERXFCON_UCEN | ERXFCON_CRCEN | ERXFCON_PMEN | ERXFCON_BCEN);
+    filterBypassed = false;
+    writeRegByte(ERXFCON, rxFilter);
   }
 }
 
-uint8_t ENC28J60::doBIST(byte CS) {
+void ENC28J60::setMulticastHash(const byte* macs, byte count) {
+  byte table[8];
+  memset(table, 0, sizeof table);
+  for (byte n = 0; n < count; ++n, macs += 6) {
+    // CRC-32 of the destination address as computed by the MAC, polynomial 0x04C11DB7
+    uint32_t crc = 0xFFFFFFFF;
+    for (byte i = 0; i < 6; ++i) {
+      byte b = macs[i];
+      for (byte j = 0; j < 8; ++j, b >>= 1) {
+        bool bit = ((crc >> 31) ^ b) & 1;
+        crc <<= 1;
+        if (bit)
+          crc ^= 0x04C11DB7;
+      }
+    }
+    // bits 28:26 select the EHT register, bits 25:23 the bit within
+    table[(crc >> 26) & 0x07] |= 1 << ((crc >> 23) & 0x07);
+  }
+  for (byte i = 0; i < sizeof table; ++i)
+    writeRegByte(EHT0 + i, table[i]);
+  if (count)
+    updateFilter(ERXFCON_HTEN, 0);
+  else
+    updateFilter(0, ERXFCON_HTEN);
+}
+
+void ENC28J60::setPatternMatch(uint16_t offset, const byte* pattern, byte len, uint64_t mask) {
+  if (len < 64)
+    mask &= ((uint64_t)1 << len) - 1;
+  // the chip compares the IP style checksum of the selected bytes
+  uint32_t sum = 0;
+  bool high = true;
+  for (byte i = 0; i < len; ++i)
+    if (mask & ((uint64_t)1 << i)) {
+      sum += high ? (uint16_t)pattern[i] << 8 : pattern[i];
+      high = !high;
+    }
+  while (sum >> 16)
+    sum = (uint16_t)sum + (sum >> 16);
+
+  updateFilter(0, ERXFCON_PMEN);  // don't match while half programmed
+  for (byte i = 0; i < 8; ++i)
+    writeRegByte(EPMM0 + i, mask >> (i * 8));
+  writeReg(EPMCS, ~(uint16_t)sum);
+  writeReg(EPMO, offset);
+  updateFilter(ERXFCON_PMEN, 0);
+}
+
+void ENC28J60::setArpPatternMatch(const byte* ip) {
+  byte pattern[42];
+  pattern[12] = 0x08;  // EtherType ARP
+  pattern[13] = 0x06;
+  memcpy(pattern + 38, ip, 4);  // target protocol address
+  setPatternMatch(0, pattern, sizeof pattern, 0x3C000003000ULL);
+}
+
+void ENC28J60::setUdpPatternMatch(uint16_t port) {
+  byte pattern[38];
+  pattern[12] = 0x08;  // EtherType IPv4
+  pattern[13] = 0x00;
+  pattern[14] = 0x45;  // version 4 without IP options
+  pattern[23] = 17;    // UDP
+  pattern[36] = port >> 8;
+  pattern[37] = port;
+  setPatternMatch(0, pattern, sizeof pattern, 0x3000807000ULL);
+}
+
+void ENC28J60::disablePatternMatch() {
+  updateFilter(0, ERXFCON_PMEN);
+}
+
+void ENC28J60::setFilterMatchAll(bool all) {
+  if (all)
+    updateFilter(ERXFCON_ANDOR, 0);
+  else
+    updateFilter(0, ERXFCON_ANDOR);
+}
+
 #define RANDOM_FILL 0b0000
 #define ADDRESS_FILL 0b0100
 #define PATTERN_SHIFT 0b1000
 #define RANDOM_RACE 0b1100
 
-// init
-#ifdef __AVR__  // if i am an AVR, do this part of the AVR-specific SPI routine.
-  if (bitRead(SPCR, SPE) == 0)
-#endif
-    initSPI();
-  selectPin = MY_CS;
-  pinMode(selectPin, OUTPUT);
-  disableChip();
+#define BIST_TIMEOUT 20  // ms; BIST and DMA over the whole 8K finish well below this
+
+// Polls a register of the current bank until the given bits clear. Gives up
+// after BIST_TIMEOUT so that a garbled SPI bus (e.g. MISO stuck high while
+// probing a too fast clock) cannot hang the caller.
+static bool waitForClear(byte address, byte mask) {
+  uint32_t start = millis();
+  while (readOp(ENC28J60_READ_CTRL_REG, address) & mask)
+    if (millis() - start > BIST_TIMEOUT)
+      return false;
+  return true;
+}
 
+static bool softReset() {
   writeOp(ENC28J60_SOFT_RESET, 0, ENC28J60_SOFT_RESET);
-  delay(2);  // errata B7/2
-  while (!readOp(ENC28J60_READ_CTRL_REG, ESTAT) & ESTAT_CLKRDY)
-    ;
+  Enc28j60Bank = 0;  // the reset selects bank 0 again
+  delay(2);          // errata B7/2
+  uint32_t start = millis();
+  while (!(readOp(ENC28J60_READ_CTRL_REG, ESTAT) & ESTAT_CLKRDY))
+    if (millis() - start > BIST_TIMEOUT)
+      return false;
+  return true;
+}
 
+// Runs the built-in self test on a freshly reset chip and checks the BIST
+// checksum against the DMA checksum of the same memory
+static bool runBIST() {
   // now we can start the memory test
   uint16_t macResult;
   uint16_t bitsResult;
@@ -844,8 +1832,8 @@ uint8_t ENC28J60::doBIST(byte CS) {
   // wait for BISTST to be reset, only after that are we actually ready to
   // start the test
   // this was undocumented :(
-  while (readOp(ENC28J60_READ_CTRL_REG, EBSTCON) & EBSTCON_BISTST)
-    ;
+  if (!waitForClear(EBSTCON, EBSTCON_BISTST))
+    return false;
   writeOp(ENC28J60_BIT_FIELD_CLR, EBSTCON, EBSTCON_TME);
 
 
@@ -853,14 +1841,14 @@ uint8_t ENC28J60::doBIST(byte CS) {
   // reached
   writeOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_DMAST | ECON1_CSUMEN);
   SetBank(EDMACS);
-  while (readOp(ENC28J60_READ_CTRL_REG, ECON1) & ECON1_DMAST)
-    ;
+  if (!waitForClear(ECON1, ECON1_DMAST))
+    return false;
   macResult = readReg(EDMACS);
   bitsResult = readReg(EBSTCS);
   // Compare the results
   // 0xF807 should always be generated in Address fill mode
   if ((macResult != bitsResult) || (bitsResult != 0xF807)) {
-    return 0;
+    return false;
   }
   // reset test flag
   writeOp(ENC28J60_BIT_FIELD_CLR, EBSTCON, EBSTCON_TME);
@@ -875,8 +1863,8 @@ uint8_t ENC28J60::doBIST(byte CS) {
   // wait for BISTST to be reset, only after that are we actually ready to
   // start the test
   // this was undocumented :(
-  while (readOp(ENC28J60_READ_CTRL_REG, EBSTCON) & EBSTCON_BISTST)
-    ;
+  if (!waitForClear(EBSTCON, EBSTCON_BISTST))
+    return false;
   writeOp(ENC28J60_BIT_FIELD_CLR, EBSTCON, EBSTCON_TME);
 
 
@@ -884,8 +1872,8 @@ uint8_t ENC28J60::doBIST(byte CS) {
   // reached
   writeOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_DMAST | ECON1_CSUMEN);
   SetBank(EDMACS);
-  while (readOp(ENC28J60_READ_CTRL_REG, ECON1) & ECON1_DMAST)
-    ;
+  if (!waitForClear(ECON1, ECON1_DMAST))
+    return false;
 
   macResult = readReg(EDMACS);
   bitsResult = readReg(EBSTCS);
@@ -893,6 +1881,81 @@ uint8_t ENC28J60::doBIST(byte CS) {
   return macResult == bitsResult;
 }
 
+uint8_t ENC28J60::doBIST(byte CS) {
+// init
+#ifdef __AVR__  // if i am an AVR, do this part of the AVR-specific SPI routine.
+  if (bitRead(SPCR, SPE) == 0)
+#endif
+    initSPI();
+  selectPin = CS;
+  initChipSelect();
+  disableChip();
+
+  if (!softReset())
+    return 0;
+  return runBIST();
+}
+
+// Writes a pseudo random block through the SPI bus, reads it back and lets
+// the DMA engine checksum the copy held in the chip. A clock that corrupts
+// either direction of the bus fails one of the two comparisons.
+static bool checkSpiRoundTrip(byte seed) {
+  byte pattern[64], readback[sizeof pattern];
+  uint32_t sum = 0;
+  for (byte i = 0; i < sizeof pattern; ++i) {
+    seed = seed * 109 + 89;
+    // alternate between worst case bit patterns and pseudo random data
+    pattern[i] = (i & 4) ? seed : (i & 1) ? 0x55 : 0xAA;
+    sum += (i & 1) ? pattern[i] : pattern[i] << 8;
+  }
+  while (sum >> 16)
+    sum = (uint16_t)sum + (sum >> 16);
+
+  writeReg(EWRPT, txStart);
+  writeBuf(sizeof pattern, pattern);
+  writeReg(ERDPT, txStart);
+  readBuf(sizeof readback, readback);
+  if (memcmp(pattern, readback, sizeof pattern) != 0)
+    return false;
+
+  writeReg(EDMAST, txStart);
+  writeReg(EDMAND, txStart + sizeof pattern - 1);
+  writeOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_DMAST | ECON1_CSUMEN);
+  if (!waitForClear(ECON1, ECON1_DMAST))
+    return false;
+  return readReg(EDMACS) == (uint16_t)~sum;
+}
+
+uint32_t ENC28J60::calibrateSpiClock(uint32_t maxClock) {
+  // clocks the ESP32 can derive exactly from its 80 MHz APB clock; below 8 MHz
+  // only the MAC/MII register reads keep running at 8 MHz (see readOp)
+  static const uint32_t clocks[] = { 20000000UL, 16000000UL, 13333333UL, 10000000UL, 8000000UL,
+                                     5000000UL, 4000000UL, 2000000UL, ENC28J60_SPI_SLOWEST_CLOCK };
+
+  initSPI();
+  initChipSelect();
+  disableChip();
+
+  // identify the silicon at the slowest clock, this also sets the ceiling
+  chipRevision = 0;
+  setSpiClock(ENC28J60_SPI_SLOWEST_CLOCK);
+  if (!softReset())
+    return 0;
+  chipRevision = readRegByte(EREVID) & 0x1F;
+
+  for (byte i = 0; i < sizeof clocks / sizeof clocks[0]; ++i) {
+    if (clocks[i] > maxClock || setSpiClock(clocks[i]) != clocks[i])
+      continue;
+    bool ok = true;
+    for (byte round = 0; ok && round < 3; ++round)
+      ok = softReset() && runBIST() && softReset() && checkSpiRoundTrip(round + millis());
+    if (ok)
+      return clocks[i];
+  }
+  setSpiClock(ENC28J60_SPI_SLOWEST_CLOCK);
+  return 0;
+}
+
 
 void ENC28J60::memcpy_to_enc(uint16_t dest, void* source, int16_t num) {
   writeReg(EWRPT, dest);
@@ -904,9 +1967,8 @@ void ENC28J60::memcpy_from_enc(void* dest, uint16_t source, int16_t num) {
   readBuf(num, (uint8_t*)dest);
 }
 
-static uint16_t endRam = ENC_HEAP_END;
 uint16_t ENC28J60::enc_malloc(uint16_t size) {
-  if (endRam - size >= ENC_HEAP_START) {
+  if (endRam - size >= scratchLimit) {
     endRam -= size;
     return endRam;
   }
@@ -914,21 +1976,21 @@ uint16_t ENC28J60::enc_malloc(uint16_t size) {
 }
 
 uint16_t ENC28J60::enc_freemem() {
-  return endRam - ENC_HEAP_START;
+  return endRam - scratchLimit;
 }
 
 uint16_t ENC28J60::readPacketSlice(char* dest, int16_t maxlength, int16_t packetOffset) {
   uint16_t erxrdpt = readReg(ERXRDPT);
   int16_t packetLength;
 
-  memcpy_from_enc((char*)&packetLength, (erxrdpt + 3) % (RXSTOP_INIT + 1), 2);
+  memcpy_from_enc((char*)&packetLength, (erxrdpt + 3) % (rxStop + 1), 2);
   packetLength -= 4;  // remove crc
 
   int16_t bytesToCopy = packetLength - packetOffset;
   if (bytesToCopy > maxlength) bytesToCopy = maxlength;
   if (bytesToCopy <= 0) bytesToCopy = 0;
 
-  int16_t startofSlice = (erxrdpt + 7 + packetOffset) % (RXSTOP_INIT + 1);
+  int16_t startofSlice = (erxrdpt + 7 + packetOffset) % (rxStop + 1);
   memcpy_from_enc(dest, startofSlice, bytesToCopy);
   dest[bytesToCopy] = 0;
 
@@ -952,3 +2014,46 @@ bool ENC28J60::is_VLAN_tagging_enabled() {
 bool ENC28J60::packet_Received_Was_Tagged() {
   return received_tagged;
 }
+
+// The driver keeps talking to its statics directly; select() copies them to the
+// context of the controller left and loads the ones of the controller chosen
+#define CONTEXT_STATE(X) \
+  X(spiBus) X(selectPin) X(Enc28j60Bank) X(chipRevision) X(spiClock) \
+  X(rxStop) X(txStart) X(txSlots) X(scratchStart) X(scratchLimit) X(endRam) X(txSlot) \
+  X(fullDuplex) X(flowControl) X(backpressure) \
+  X(linkUp) X(lastLinkPoll) X(linkCallback) X(phyScan) X(rxFilter) X(filterBypassed) \
+  X(intPin) X(intLine) X(lastPoll) X(asyncSend) X(txPending) X(txRetry) X(txCallback) \
+  X(checksumOffload) X(checksumVerify) X(packetFilter) X(gNextPacketPtr) X(unreleasedPacket) \
+  X(bufferSize) X(broadcast_enabled) X(promiscuous_enabled) \
+  X(tagging_enabled) X(received_tagged) X(vlanID) X(vlan_TCI_PCP) X(vlan_TCI_DEI) X(stats)
+
+
+void ENC28J60::select(ENC28J60Context* context) {
+  if (context == currentContext)
+    return;
+  ENC28J60Context* from = currentContext ? currentContext : &primaryContext;
+  ENC28J60Context* to = context ? context : &primaryContext;
+#define SAVE_STATE(name) from->name = name;
+#define LOAD_STATE(name) name = to->name;
+  CONTEXT_STATE(SAVE_STATE)
+  CONTEXT_STATE(LOAD_STATE)
+#undef SAVE_STATE
+#undef LOAD_STATE
+  ENC28J60_BUS::useBus(spiBus);
+  currentContext = context;
+  events = &to->events;
+
+  // per frame state does not survive a switch
+  checksumJobCount = 0;
+  txPayloadOffset = 0;
+  txPayloadUnsummed = false;
+
+  if (chipRevision == 0)
+    return;  // not initialized yet
+  ENC28J60_BUS::setClock(spiClock);
+  initChipSelect();
+}
+
+ENC28J60Context* ENC28J60::selected() {
+  return currentContext;
+}
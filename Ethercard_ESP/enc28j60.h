@@ -22,24 +22,240 @@
 // buffer boundaries applied to internal 8K ram
 // the entire available packet buffer space is allocated
 
+// Default partition of the 8 KB buffer memory; initialize() accepts an ENC28J60Layout
+// to choose another split at run time
 #define RXSTART_INIT 0x0000  // start of RX buffer, (must be zero, Rev. B4 Errata point 5)
 #define RXSTOP_INIT 0x0BFF   // end of RX buffer, room for 2 packets
 
-#define TXSTART_INIT 0x0C00  // start of TX buffer, room for 1 packet
-#define TXSTOP_INIT 0x11FF   // end of TX buffer
+/** Default number of transmit slots in the ENC28J60 buffer memory.
+*   With two or more slots packetSend() copies the next frame into a free slot while the
+*   previous one is still being transmitted and collects the result of a transmission
+*   only when the next frame is started. Every additional slot takes TX_SLOT_SIZE bytes
+*   from the scratch (stash) area: the default of one leaves 3.5 KB (56 pages) for stashes,
+*   two leave 2 KB (32 pages). Opt in by defining ETHERCARD_TX_SLOTS as 2 in the build
+*   flags, or by passing an ENC28J60Layout with txSlots = 2 to EtherCard::begin().
+*/
+#ifndef ETHERCARD_TX_SLOTS
+#define ETHERCARD_TX_SLOTS 1
+#endif
 
-#define SCRATCH_START 0x1200  // start of scratch area
-#define SCRATCH_LIMIT 0x2000  // past end of area, i.e. 3 Kb
+#define TX_SLOT_SIZE 0x0600  // control byte, frame and transmit status vector
+#define TXSTART_INIT 0x0C00  // start of TX buffer
+#define TXSTOP_INIT (TXSTART_INIT + ETHERCARD_TX_SLOTS * TX_SLOT_SIZE - 1)  // end of TX buffer
+
+#define SCRATCH_START (TXSTOP_INIT + 1)  // start of scratch area
+#define SCRATCH_LIMIT 0x2000  // past end of area, i.e. 3.5 KB with one TX slot
 #define SCRATCH_PAGE_SHIFT 6  // addressing is in pages of 64 bytes
 #define SCRATCH_PAGE_SIZE (1 << SCRATCH_PAGE_SHIFT)
 #define SCRATCH_PAGE_NUM ((SCRATCH_LIMIT - SCRATCH_START) >> SCRATCH_PAGE_SHIFT)
-#define SCRATCH_MAP_SIZE (((SCRATCH_PAGE_NUM % 8) == 0) ? (SCRATCH_PAGE_NUM / 8) : (SCRATCH_PAGE_NUM / 8 + 1))
 
-// area in the enc memory that can be used via enc_malloc; by default 0 bytes; decrease SCRATCH_LIMIT in order
-// to use this functionality
+// area in the enc memory that can be used via enc_malloc; by default 0 bytes; pass an ENC28J60Layout with a
+// heapSize to the layout argument of EtherCard::begin() (or initialize()) in order to use this functionality
 #define ENC_HEAP_START SCRATCH_LIMIT
 #define ENC_HEAP_END 0x2000
 
+// limits checked by initialize() for a custom layout
+#define ENC28J60_MEMORY_SIZE 0x2000
+#define ENC28J60_MIN_RX_SIZE 0x0600  // one maximum sized frame plus its header
+#define SCRATCH_PAGE_MAX ((ENC28J60_MEMORY_SIZE - ENC28J60_MIN_RX_SIZE - TX_SLOT_SIZE) >> SCRATCH_PAGE_SHIFT)
+#define SCRATCH_MAP_SIZE (((SCRATCH_PAGE_MAX % 8) == 0) ? (SCRATCH_PAGE_MAX / 8) : (SCRATCH_PAGE_MAX / 8 + 1))
+
+// SPI clock limits; the data sheet allows up to 20 MHz and the silicon errata
+// advise against reading MAC/MII registers with an SPI clock below 8 MHz, so
+// those reads run at ENC28J60_SPI_MIN_CLOCK whenever the bus is set slower
+#define ENC28J60_SPI_MIN_CLOCK 8000000UL
+#define ENC28J60_SPI_MAX_CLOCK 20000000UL
+#define ENC28J60_SPI_SLOWEST_CLOCK 1000000UL  // lowest clock setSpiClock() accepts, for marginal wiring
+#define ENC28J60_SPI_CLOCK ENC28J60_SPI_MIN_CLOCK  // default clock used by initialize()
+#define ENC28J60_SPI_CLOCK_AUTO 0                  // let initialize() pick the clock with calibrateSpiClock()
+
+// default wiring per platform; define these in the build flags for another board
+#ifndef ENC28J60_CS_PIN
+#if defined(__AVR__)
+#define ENC28J60_CS_PIN 8
+#elif defined(ESP8266)
+#define ENC28J60_CS_PIN 15
+#elif defined(__STM32F1__)
+#define ENC28J60_CS_PIN PA8
+#else
+#define ENC28J60_CS_PIN 5
+#endif
+#endif
+#ifndef ENC28J60_SCLK_PIN
+#if defined(__AVR__)
+#define ENC28J60_SCLK_PIN 13
+#elif defined(ESP8266)
+#define ENC28J60_SCLK_PIN 14
+#elif defined(__STM32F1__)
+#define ENC28J60_SCLK_PIN PA5
+#else
+#define ENC28J60_SCLK_PIN 18
+#endif
+#endif
+#ifndef ENC28J60_MISO_PIN
+#if defined(__AVR__) || defined(ESP8266)
+#define ENC28J60_MISO_PIN 12
+#elif defined(__STM32F1__)
+#define ENC28J60_MISO_PIN PA6
+#else
+#define ENC28J60_MISO_PIN 19
+#endif
+#endif
+#ifndef ENC28J60_MOSI_PIN
+#if defined(__AVR__)
+#define ENC28J60_MOSI_PIN 11
+#elif defined(ESP8266)
+#define ENC28J60_MOSI_PIN 13
+#elif defined(__STM32F1__)
+#define ENC28J60_MOSI_PIN PA7
+#else
+#define ENC28J60_MOSI_PIN 23
+#endif
+#endif
+
+// bits of the PHY status returned by getPhyStatus() (PHSTAT2)
+#define ENC28J60_PHY_LINK 0x0400
+#define ENC28J60_PHY_FULL_DUPLEX 0x0200
+#define ENC28J60_PHY_POLARITY_REVERSED 0x0020
+
+// fill level of the RX ring in percent at which flow control starts and ends
+#define ENC28J60_RX_HIGH_WATER 75
+#define ENC28J60_RX_LOW_WATER 25
+
+#define ENC28J60_CHECKSUM_JOBS 3  // checksums packetSend() can offload per frame
+
+#define ENC28J60_PEEK_LEN 54  // Ethernet, IPv4 and TCP header without options
+
+/** This type definition defines the structure of a receive filter callback function.
+*   It is called with the first ENC28J60_PEEK_LEN bytes of the frame in the data buffer
+*   and returns false if the rest of the frame should not be copied. The tag of our VLAN
+*   is already stripped.
+*/
+typedef bool (*PacketFilterCallback)(
+  uint16_t len  ///< Length of the whole frame
+);
+
+/** This structure describes a host buffer for packetReceiveBatch(). */
+typedef struct {
+  uint8_t* data;  ///< Buffer the frame is copied to
+  uint16_t size;  ///< Size of the buffer, more than 16; frames are clipped to size - 1 bytes and 0-terminated
+  uint16_t len;   ///< Length of the received frame
+  bool tagged;    ///< True if the frame carried our VLAN tag (already stripped)
+} PacketDescriptor;
+
+#define ENC28J60_CAPTURE_SNAPLEN 64  // default bytes kept of each captured frame
+
+/** Selects the frames setCapture() records; zero fields match everything */
+typedef struct {
+  uint16_t etherType;  ///< EtherType, behind the VLAN tag for tagged frames
+  uint8_t ip[4];       ///< IPv4 source or destination address
+  uint16_t port;       ///< UDP or TCP source or destination port
+} CaptureFilter;
+
+/** Header of a captured frame, see ENC28J60::captureNext() */
+typedef struct {
+  uint32_t timestamp;  ///< Time of capture, from micros()
+  uint16_t len;        ///< Length of the frame
+  uint16_t capLen;     ///< Bytes kept, at most the snap length
+  bool tx;             ///< True for frames sent, false for frames received
+} CaptureRecord;
+
+/** Partition of the ENC28J60 buffer memory. The RX ring starts at 0, the TX slots follow,
+*   the heap for enc_malloc() sits at the end and the scratch (stash) area gets the rest.
+*/
+typedef struct {
+  uint16_t rxSize;    ///< Bytes of the RX ring, even and at least ENC28J60_MIN_RX_SIZE
+  uint8_t txSlots;    ///< Number of TX slots of TX_SLOT_SIZE bytes, at least 1
+  uint16_t heapSize;  ///< Bytes reserved for enc_malloc()
+} ENC28J60Layout;
+
+/** Counters of the driver and the stack, see ENC28J60::getStats().
+*   Only rxOverflows and rxBadChecksum are counted if ETHERCARD_STATS is 0.
+*/
+typedef struct {
+  uint32_t rxFrames;        ///< Frames read from the ENC28J60
+  uint32_t txFrames;        ///< Frames handed to the ENC28J60 for transmission
+  uint32_t rxDropped;       ///< Received frames dropped, the sum of the rx counters below except rxOverflows
+  uint32_t rxNotForUs;      ///< Dropped by the early drop filter or not addressed to us
+  uint32_t rxBadLength;     ///< Dropped because the receive status vector reported an error (length, CRC) or the buffer has 16 bytes or less
+  uint32_t rxVlanMismatch;  ///< Dropped because of a foreign VLAN tag
+  uint32_t rxUnhandled;     ///< Dropped because no one handles the protocol
+  uint32_t rxBadChecksum;   ///< Dropped by setChecksumVerify()
+  uint32_t rxOverflows;     ///< RX ring overflows, each of them lost one or more frames
+  uint32_t txErrors;        ///< Transmissions that failed or timed out
+  uint32_t txRetries;       ///< Transmissions retried after a late collision
+  uint32_t spiBytes;        ///< Bytes moved to and from the ENC28J60 buffer memory
+  uint32_t arp;             ///< ARP messages received for our IP
+  uint32_t icmp;            ///< ICMP messages received
+  uint32_t udp;             ///< UDP datagrams received
+  uint32_t tcp;             ///< TCP segments received
+  uint16_t dhcpTimeouts;    ///< DHCP requests without answer
+  uint16_t dnsTimeouts;     ///< DNS lookups without answer
+} NetStats;
+
+/** Called when the link goes up or down */
+typedef void (*LinkCallback)(bool up);
+
+/** Called when an asynchronous transmission has finished, success is false on a transmit error or timeout */
+typedef void (*TransmitCallback)(bool success);
+
+/** Interrupt flags of one ENC28J60, set by the handler of its INT line */
+struct ENC28J60Events {
+  volatile bool rxPending = false;  ///< Packets may be waiting
+  volatile bool txEvent = false;    ///< A transmission may have finished
+  volatile bool linkEvent = false;  ///< The link may have changed
+};
+
+/** Driver state of one ENC28J60, see ENC28J60::select(). The members mirror the driver internals
+*   and are only meant to be touched by select(); a new context describes a controller that still
+*   has to be set up with initSPI() and initialize().
+*/
+struct ENC28J60Context {
+  SPIClass* spiBus = NULL;  ///< SPI bus, NULL for the default bus
+  uint8_t selectPin = 0;
+  uint8_t Enc28j60Bank = 0;
+  uint8_t chipRevision = 0;
+  uint32_t spiClock = ENC28J60_SPI_MIN_CLOCK;
+  uint16_t rxStop = RXSTOP_INIT;
+  uint16_t txStart = TXSTART_INIT;
+  uint8_t txSlots = ETHERCARD_TX_SLOTS;
+  uint16_t scratchStart = SCRATCH_START;
+  uint16_t scratchLimit = SCRATCH_LIMIT;
+  uint16_t endRam = ENC_HEAP_END;
+  uint8_t txSlot = 0;
+  bool fullDuplex = false;
+  bool flowControl = false;
+  bool backpressure = false;
+  bool linkUp = false;
+  uint32_t lastLinkPoll = 0;
+  LinkCallback linkCallback = NULL;
+  bool phyScan = false;
+  uint8_t rxFilter = 0;
+  bool filterBypassed = false;
+  uint8_t intPin = 0xFF;
+  uint8_t intLine = 0xFF;
+  uint32_t lastPoll = 0;
+  bool asyncSend = false;
+  bool txPending = false;
+  uint8_t txRetry = 0;
+  TransmitCallback txCallback = NULL;
+  bool checksumOffload = false;
+  bool checksumVerify = false;
+  PacketFilterCallback packetFilter = NULL;
+  uint16_t gNextPacketPtr = RXSTART_INIT;
+  bool unreleasedPacket = false;
+  uint16_t bufferSize = 0;
+  bool broadcast_enabled = false;
+  bool promiscuous_enabled = false;
+  bool tagging_enabled = false;
+  bool received_tagged = false;
+  uint16_t vlanID = 0;
+  uint8_t vlan_TCI_PCP = 0;
+  uint8_t vlan_TCI_DEI = 0;
+  NetStats stats = NetStats();
+  ENC28J60Events events;  ///< Set in interrupt context, so select() does not copy them
+};
+
 /** This class provide low-level interfacing with the ENC28J60 network interface. This is used by the EtherCard class and not intended for use by (normal) end users. */
 class ENC28J60 {
 public:
@@ -70,45 +286,220 @@ public:
 
   static SPIClass& getSPIinstance(void);  // Get SPI class handle
 
+  /**   @brief  Switch the driver to another ENC28J60
+    *     @param  context State of the controller to talk to from now on, NULL for the default one
+    *     @note   The state of the controller selected so far is saved to its context first. This only switches the
+    *             driver; EtherCard::select() switches the addresses and the rest of the TCP/IP stack as well. All
+    *             controllers share the data buffer, so finish with a frame before switching.
+    *     @note   The interrupt flags stay in the context of each controller, so none is lost by a switch.
+    */
+  static void select(ENC28J60Context* context);
+
+  /**   @brief  Get the context of the selected ENC28J60
+    *     @return <i>ENC28J60Context*</i> Context passed to the last select(), NULL for the default controller
+    */
+  static ENC28J60Context* selected();
+
+  /**   @brief  Set the SPI clock used for all transactions with the ENC28J60
+    *     @param  hz Requested clock in Hz
+    *     @return <i>uint32_t</i> Clock actually configured
+    *     @note   The clock is clamped to ENC28J60_SPI_SLOWEST_CLOCK .. ENC28J60_SPI_MAX_CLOCK. Until initialize() has
+    *             identified a known silicon revision the ceiling is ENC28J60_SPI_MIN_CLOCK.
+    *     @note   ENC28J60_SPI_MIN_CLOCK is the recommended minimum. Below it, MAC and MII register reads still run at
+    *             ENC28J60_SPI_MIN_CLOCK (silicon errata), everything else at the clock set.
+    *     @note   On AVR the SPI runs at the fastest divider of F_CPU that is not above the clock.
+    */
+  static uint32_t setSpiClock(uint32_t hz);
+
+  /**   @brief  Get the SPI clock currently used for the ENC28J60
+    *     @return <i>uint32_t</i> Clock in Hz
+    */
+  static uint32_t getSpiClock();
+
   /**   @brief  Initialise network interface
     *     @param  size Size of data buffer
     *     @param  macaddr Pointer to 6 byte hardware (MAC) address
-    *     @param  csPin Arduino pin used for chip select (enable network interface SPI bus). Default = 8
-    *     @return <i>uint8_t</i> ENC28J60 firmware version or zero on failure.
+    *     @param  csPin Arduino pin used for chip select (enable network interface SPI bus). Default = ENC28J60_CS_PIN
+    *     @param  spiClock SPI clock in Hz, limited to what the detected silicon revision supports (see setSpiClock).
+    *             ENC28J60_SPI_CLOCK_AUTO runs calibrateSpiClock() first.
+    *     @param  layout Partition of the buffer memory. Default = NULL for RXSTOP_INIT, ETHERCARD_TX_SLOTS and no heap
+    *     @param  fullDuplex True to run PHY and MAC in full duplex with pause frame flow control. Default = false
+    *             The ENC28J60 does not autonegotiate, so the link partner has to be set to full duplex as well;
+    *             a switch port left on autonegotiation falls back to half duplex and the duplex mismatch costs frames.
+    *     @return <i>uint8_t</i> ENC28J60 firmware version or zero on failure, also if the layout does not fit.
     */
-#if defined(__AVR__)
-  static uint8_t initialize(const uint16_t size, const uint8_t* macaddr,
-                            uint8_t csPin = 8);
-#endif
-#if defined(ESP8266)
-  static uint8_t initialize(const uint16_t size, const uint8_t* macaddr,
-                            uint8_t csPin = 15);
-#endif
-#if defined(ESP32)
   static uint8_t initialize(const uint16_t size, const uint8_t* macaddr,
-                            uint8_t csPin = 5);
-#endif
-#if defined(__STM32F1__)
-  static uint8_t initialize(const uint16_t size, const uint8_t* macaddr,
-                            uint8_t csPin = PA8);
-#endif
+                            uint8_t csPin = ENC28J60_CS_PIN,
+                            uint32_t spiClock = ENC28J60_SPI_CLOCK,
+                            const ENC28J60Layout* layout = NULL,
+                            bool fullDuplex = false);
+  /**   @brief  Get the number of scratch (stash) pages of the current layout
+    *     @return <i>uint8_t</i> Pages of SCRATCH_PAGE_SIZE bytes
+    */
+  static uint8_t scratchPages();
+
   /**   @brief  Check if network link is connected
     *     @return <i>bool</i> True if link is up
+    *     @note   Returns the state cached from the link change interrupt; the ENC28J60 is asked for a change at most
+    *             every 250 ms, or when its INT line fired if enableInterrupt() is used.
     */
   static bool isLinkUp();
 
+  /**   @brief  Check whether initialize() configured full duplex
+    *     @return <i>bool</i> True in full duplex
+    */
+  static bool isFullDuplex();
+
+  static NetStats stats;  //!< Counters, read them with getStats()
+
+  /**   @brief  Copy the statistics counters
+    *     @param  snapshot Structure to copy the counters to
+    *     @param  reset True to clear the counters afterwards. Default = false
+    */
+  static void getStats(NetStats& snapshot, bool reset = false);
+
+  /**   @brief  Clear the statistics counters
+    */
+  static void resetStats();
+
+  /**   @brief  Watch the fill level of the RX ring
+    *     @param  enable True to track backpressure; in full duplex PAUSE frames are sent as well
+    *     @note   Enabled by initialize() in full duplex. Backpressure starts when the ring is ENC28J60_RX_HIGH_WATER
+    *             percent full and ends at ENC28J60_RX_LOW_WATER percent; the level is checked in packetReceive().
+    */
+  static void setFlowControl(bool enable);
+
+  /**   @brief  Check whether the RX ring is filling up
+    *     @return <i>bool</i> True while the application should slow down its own traffic
+    */
+  static bool isBackpressure();
+
+  /**   @brief  Get the number of RX ring overflows, each of them lost one or more frames
+    *     @return <i>uint32_t</i> Number of overflows
+    */
+  static uint32_t getRxOverflows();
+
+  /**   @brief  Let the MAC read the PHY status continuously (MII scan mode)
+    *     @note   Call after initialize(). getPhyStatus() then reads the latest status from MIRDH without an MII cycle.
+    *             Other PHY accesses pause the scan.
+    */
+  static void enablePhyScan();
+
+  /**   @brief  Stop the MII scan mode
+    */
+  static void disablePhyScan();
+
+  /**   @brief  Get the PHY status register (PHSTAT2)
+    *     @return <i>uint16_t</i> Status, test it with ENC28J60_PHY_LINK, ENC28J60_PHY_FULL_DUPLEX and ENC28J60_PHY_POLARITY_REVERSED
+    *     @note   With enablePhyScan() only the high byte is read, a single SPI transaction (plus a bank switch if
+    *             another bank is selected), so ENC28J60_PHY_POLARITY_REVERSED reads as zero. Without the scan every
+    *             call runs an MII read cycle.
+    */
+  static uint16_t getPhyStatus();
+
+  /**   @brief  Register a function to call when the link goes up or down
+    *     @param  callback Function called from isLinkUp() or packetReceive(), NULL to remove it
+    */
+  static void setLinkCallback(LinkCallback callback);
+
   /**   @brief  Sends data to network interface
     *     @param  len Size of data to send
     *     @note   Data buffer is shared by recieve and transmit functions
     */
   static void packetSend(uint16_t len);
 
+  /**   @brief  Let the DMA engine of the ENC28J60 compute the checksums of outgoing frames
+    *     @param  enable True to queue checksums with queueChecksum() instead of computing them on the host
+    *     @note   Off by default; the chip sums up the frame after it has been written to the TX buffer.
+    */
+  static void setChecksumOffload(bool enable);
+
+  /**   @brief  Check whether checksum offloading is enabled
+    *     @return <i>bool</i> True if enabled
+    */
+  static bool isChecksumOffload();
+
+  /**   @brief  Have packetSend() compute a checksum in the ENC28J60 buffer memory
+    *     @param  dest Offset of the 16 bit checksum field in the frame
+    *     @param  off Offset of the first byte to sum up
+    *     @param  len Number of bytes to sum up, the range has to include the checksum field
+    *     @return <i>bool</i> False if offloading is disabled or the queue is full; compute the checksum on the host then
+    *     @note   The checksum field must hold the sum of what is not in the range (e.g. the rest of the pseudo header), else 0.
+    *     @note   If the range reaches into a payload built with txPayloadBegin(), the host cannot sum it up: a false return
+    *             then makes packetSend() drop the frame and count it in txErrors.
+    */
+  static bool queueChecksum(uint16_t dest, uint16_t off, uint16_t len);
+
+  /**   @brief  Verify the IP, UDP, TCP and ICMP checksums of received frames with the DMA engine of the ENC28J60
+    *     @param  enable True to drop IPv4 frames with a bad checksum in packetReceive()
+    *     @note   Off by default; frames clipped to the buffer size and IP fragments are not checked.
+    */
+  static void setChecksumVerify(bool enable);
+
+  /**   @brief  Get the number of frames dropped because of a bad checksum
+    *     @return <i>uint32_t</i> Number of frames
+    */
+  static uint32_t getChecksumErrors();
+
+  /**   @brief  Let packetSend() return as soon as the transmission is started
+    *     @param  enable True to return right after setting TXRTS, false to wait for the result (default)
+    *     @param  callback Optional function called with the result of every transmission. Default = NULL
+    *     @note   Results, including late collision retries, are collected by isTxBusy() and packetReceive().
+    *             With enableInterrupt() the TX interrupts are used, so polling costs no SPI transactions.
+    *     @note   The next packetSend() still waits for the previous frame if its TX slot is in use.
+    */
+  static void setAsyncSend(bool enable, TransmitCallback callback = NULL);
+
+  /**   @brief  Check whether a transmission is still in progress
+    *     @return <i>bool</i> True while the frame started last has not finished
+    */
+  static bool isTxBusy();
+
   /**   @brief  Copy recieved packets to data buffer
     *     @return <i>uint16_t</i> Size of recieved data
     *     @note   Data buffer is shared by recieve and transmit functions
     */
   static uint16_t packetReceive();
 
+  /**   @brief  Copy all pending packets into a set of host buffers in one pass
+    *     @param  ring Array of packet descriptors
+    *     @param  count Number of descriptors in ring
+    *     @return <i>uint8_t</i> Number of descriptors filled with a valid frame
+    *     @note   The receive buffer space of all copied frames is released right away, so the chip can keep
+    *             receiving during bursts while the batch is processed. readPacketSlice() can not be used on them.
+    *     @note   The packet filter (setPacketFilter) is not applied.
+    *     @note   Descriptors need a size of more than 16 bytes; the batch ends at a smaller one.
+    *     @note   Like packetReceive() it first collects transmission results and link changes.
+    */
+  static uint8_t packetReceiveBatch(PacketDescriptor* ring, uint8_t count);
+
+  /**   @brief  Install a filter that sees the headers of each frame before its payload is copied
+    *     @param  filter Filter function or NULL to copy all frames
+    *     @note   Frames longer than ENC28J60_PEEK_LEN are first read up to that length; if the filter rejects
+    *             them packetReceive() returns 0 and the frame is released without reading the rest.
+    */
+  static void setPacketFilter(PacketFilterCallback filter);
+
+  /**   @brief  Use the INT line of the ENC28J60 instead of polling for received packets
+    *     @param  intPin Arduino pin connected to the INT output of the ENC28J60
+    *     @param  callback Optional function called from the interrupt handler, e.g. to notify a task. Default = NULL
+    *     @note   Call after initialize(). packetReceive() then only reads EPKTCNT over SPI while INT is asserted
+    *             (plus a slow fallback poll), so idle calls cost no SPI transactions.
+    *     @note   The callback runs in interrupt context and must not access the ENC28J60.
+    *     @note   Up to three controllers (see select()) can use their INT line at the same time; further ones keep
+    *             polling.
+    */
+  static void enableInterrupt(uint8_t intPin, void (*callback)() = NULL);
+
+  /**   @brief  Detach the INT line and go back to polling EPKTCNT on every packetReceive()
+    */
+  static void disableInterrupt();
+
+  /**   @brief  Check whether packetReceive() has to look at the chip
+    *     @return <i>bool</i> True if INT is asserted, an interrupt is pending or interrupt mode is not used
+    */
+  static bool isPacketPending();
+
   /**   @brief  Copy data from ENC28J60 memory
     *     @param  page Data page of memory
     *     @param  data Pointer to buffer to copy data to
@@ -128,6 +519,26 @@ public:
     */
   static uint8_t peekin(uint8_t page, uint8_t off);
 
+  /**   @brief  Build the payload of the next frame directly in the TX buffer
+    *     @param  offset Offset of the payload in the frame; packetSend() then only writes the bytes in front of it from the buffer
+    *     @note   Fill the payload with txPayloadWrite() and txPayloadCopy() before calling packetSend() with the full length.
+    *             Checksums covering the payload need setChecksumOffload().
+    */
+  static void txPayloadBegin(uint16_t offset);
+
+  /**   @brief  Append data from the host to the payload started with txPayloadBegin()
+    *     @param  data Pointer to the data
+    *     @param  len Number of bytes
+    */
+  static void txPayloadWrite(const void* data, uint16_t len);
+
+  /**   @brief  Append data from a scratch page to the payload, copied by the DMA engine of the ENC28J60
+    *     @param  page Data page of memory
+    *     @param  off Offset of data within page
+    *     @param  len Number of bytes, must not cross the end of the page
+    */
+  static void txPayloadCopy(uint8_t page, uint8_t off, uint8_t len);
+
   /**   @brief  Put ENC28J60 in sleep mode
     */
   static void powerDown();  // contrib by Alex M.
@@ -172,27 +583,96 @@ public:
     */
   static void disablePromiscuous(bool temporary = false);
 
+  /**   @brief  Record the start of every frame received or sent in a ring in RAM
+    *     @param  ring Memory for the ring, e.g. from ps_malloc(); NULL stops capturing
+    *     @param  size Size of ring in bytes
+    *     @param  snaplen Bytes kept of each frame
+    *     @param  filter Frames to record, NULL for all
+    *     @return <i>bool</i> False if ring cannot hold a single frame
+    *     @note   When the ring is full the oldest record is overwritten, see captureLost().
+    *     @note   Only frames passing the receive filters are seen; use enablePromiscuous() to capture the
+    *             whole segment. Checksums computed by the ENC28J60 (setChecksumOffload) are recorded as zero.
+    *     @note   One ring serves all controllers selected with select().
+    */
+  static bool setCapture(uint8_t* ring, uint32_t size, uint16_t snaplen = ENC28J60_CAPTURE_SNAPLEN,
+                         const CaptureFilter* filter = NULL);
+
+  /**   @brief  Get the oldest captured frame
+    *     @param  record Header of the frame
+    *     @param  remove False to leave the frame in the ring
+    *     @return <i>const uint8_t*</i> The bytes kept of the frame, NULL if the ring is empty
+    *     @note   The bytes stay valid until the next frame is captured.
+    */
+  static const uint8_t* captureNext(CaptureRecord& record, bool remove = true);
+
+  /**   @brief  Stop or resume recording frames, e.g. while sending the capture
+    *     @param  pause True to stop recording
+    */
+  static void pauseCapture(bool pause);
+
+  /**   @brief  Get the number of captured frames overwritten before they were read
+    *     @return <i>uint32_t</i> Frames lost since setCapture()
+    */
+  static uint32_t captureLost();
+
   /**   @brief  Disable reception of mulitcast messages
     *     @note   This will reduce load on recieved data handling
     */
   static void disableMulticast();
 
+  /**   @brief  Accept multicast messages for the given groups with the hash table filter
+    *     @param  macs Group MAC addresses, 6 bytes each
+    *     @param  count Number of addresses, 0 disables the hash table filter
+    *     @note   The 64 bit hash table lets some other groups through, but most multicast is dropped by the ENC28J60
+    */
+  static void setMulticastHash(const uint8_t* macs, uint8_t count);
+
+  /**   @brief  Accept messages matching a pattern
+    *     @param  offset Offset of the 64 byte pattern window in the frame, must be even
+    *     @param  pattern Frame contents expected in the window
+    *     @param  len Length of pattern, up to 64 bytes
+    *     @param  mask Bit n set compares byte n of the window
+    *     @note   Replaces the default pattern, which accepts ARP broadcasts. disablePromiscuous() keeps the pattern.
+    */
+  static void setPatternMatch(uint16_t offset, const uint8_t* pattern, uint8_t len, uint64_t mask);
+
+  /**   @brief  Accept only those ARP messages through the pattern filter that ask for an IP address
+    *     @param  ip IP address (4 bytes)
+    */
+  static void setArpPatternMatch(const uint8_t* ip);
+
+  /**   @brief  Accept UDP messages to a port through the pattern filter
+    *     @param  port UDP destination port
+    *     @note   Only matches IP headers without options
+    */
+  static void setUdpPatternMatch(uint16_t port);
+
+  /**   @brief  Stop accepting messages through the pattern filter
+    */
+  static void disablePatternMatch();
+
+  /**   @brief  Select how the enabled receive filters combine
+    *     @param  all True to accept only messages matching every enabled filter, false to accept messages matching any (default)
+    *     @note   E.g. disable broadcast, call setUdpPatternMatch() and set this to only receive unicast UDP for one port
+    */
+  static void setFilterMatchAll(bool all);
+
   /**   @brief  Reset and fully initialise ENC28J60
     *     @param  csPin Arduino pin used for chip select (enable SPI bus)
     *     @return <i>uint8_t</i> 0 on failure
     */
-#if defined(__AVR__)
-  static uint8_t doBIST(uint8_t csPin = 8);
-#endif
-#if defined(ESP8266)
-  static uint8_t doBIST(uint8_t csPin = 15);
-#endif
-#if defined(ESP32)
-  static uint8_t doBIST(uint8_t csPin = 5);
-#endif
-#if defined(__STM32F1__)
-  static uint8_t doBIST(uint8_t csPIN = PA8);
-#endif
+  static uint8_t doBIST(uint8_t csPin = ENC28J60_CS_PIN);
+
+  /**   @brief  Find the fastest SPI clock that works reliably on this board
+    *     @param  maxClock Upper bound for the clocks tried
+    *     @return <i>uint32_t</i> Fastest verified clock in Hz or zero if not even ENC28J60_SPI_SLOWEST_CLOCK works
+    *     @note   Goes on below ENC28J60_SPI_MIN_CLOCK for long cables or level shifters; the MAC and MII register
+    *             reads then stay at ENC28J60_SPI_MIN_CLOCK (see setSpiClock).
+    *     @note   Tries descending clocks; each one has to pass the built-in self test and a write / read back /
+    *             DMA checksum round trip three times in a row. The chip is reset, so call this before initialize()
+    *             (or pass ENC28J60_SPI_CLOCK_AUTO to it).
+    */
+  static uint32_t calibrateSpiClock(uint32_t maxClock = ENC28J60_SPI_MAX_CLOCK);
 
   /**   @brief  Copies a slice from the current packet to RAM
     *     @param  dest pointer in RAM where the data is copied to
@@ -207,7 +687,7 @@ public:
      *  @param  size number of bytes to reserve
      *  @return <i>uint16_t</i> start address of the block within the enc memory. 0 if the remaining memory for malloc operation is less than size.   
      *  @note  There is no enc_free(), i.e., reserved blocks stay reserved for the duration of the program. 
-     *  @note  The total memory available for malloc-operations is determined by ENC_HEAP_END-ENC_HEAP_START, defined in enc28j60.h; by default this is 0, i.e., you have to change these values in order to use enc_malloc().  
+     *  @note  The total memory available for malloc-operations is the heapSize of the ENC28J60Layout passed to initialize(); by default this is 0, i.e., you have to pass a layout in order to use enc_malloc().  
      */
   static uint16_t enc_malloc(uint16_t size);
 
@@ -269,6 +749,28 @@ typedef ENC28J60 Ethernet;  //!< Define alias Ethernet for ENC28J60
 *   ETHERCARD_RETRY_LATECOLLISIONS this may lead to problems because a packet whose
 *   transmission fails because the ENC-chip thinks that it is a late collision will
 *   not be retried until the next call to packetSend.
+*   With ETHERCARD_TX_SLOTS > 1 transmissions are always pipelined.
 */
 #define ETHERCARD_SEND_PIPELINING 0
+
+/** Enable the statistics counters in NetStats.
+*   Setting this to zero removes the counting from the receive and transmit paths;
+*   RX overflows and checksum errors are still counted.
+*/
+#define ETHERCARD_STATS 1
+
+/** Enable frame capture with setCapture().
+*   While no ring is set, capturing costs one test per frame; setting this to zero removes it.
+*/
+#define ETHERCARD_CAPTURE 1
+
+#if ETHERCARD_STATS
+#define NETSTAT_INC(field) (++ENC28J60::stats.field)
+#define NETSTAT_ADD(field, n) (ENC28J60::stats.field += (n))
+#define NETSTAT_DROP(reason) (++ENC28J60::stats.rxDropped, ++ENC28J60::stats.reason)
+#else
+#define NETSTAT_INC(field)
+#define NETSTAT_ADD(field, n)
+#define NETSTAT_DROP(reason)
+#endif
 #endif
@@ -0,0 +1,142 @@
+// SPI bus policies for the ENC28J60 driver
+// Copyright: GPL V2
+//
+// The register and buffer memory access in enc28j60.cpp is written against a
+// bus policy given as a template parameter, so every build gets a fully inlined
+// transfer loop for its platform. A policy is a struct with static members:
+//
+//   static void init();                                    set up pins and bus
+//   static void begin();                                   start a transaction (chip select is done by the driver)
+//   static void end();                                     end it
+//   static uint8_t transfer(uint8_t data);                 exchange one byte
+//   static void read(uint8_t* data, uint16_t len);         clock in len bytes
+//   static void write(const uint8_t* data, uint16_t len);  clock out len bytes
+//   static void setClock(uint32_t hz);                     SPI clock of the following transactions
+//   static void useBus(SPIClass* bus);                     bus of the selected controller, NULL for the default
+//
+// The driver reaches the bus only through these, so setSpiClock(), initSPI()
+// and ENC28J60::select() work with any policy. Only SpiClassBus can change its
+// bus at run time: it keeps the SPIClass behind a pointer, which costs one
+// indirection per call. Policies for a fixed bus, like AvrSpiBus, ignore
+// useBus().
+//
+// ENC28J60_BUS names the policy used; define it in the build flags (together
+// with a header declaring the policy) to plug in another one.
+/** @file */
+
+#ifndef ENC28J60_BUS_H
+#define ENC28J60_BUS_H
+
+#include <SPI.h>
+
+#ifdef __AVR__
+/** Hardware SPI of the AVR, driven through its registers */
+struct AvrSpiBus {
+  static void init();
+
+  static void setClock(uint32_t hz);
+
+  static void useBus(SPIClass*) {}
+
+  static void begin() {}
+
+  static void end() {}
+
+  static uint8_t transfer(uint8_t data) {
+    SPDR = data;
+    while (!(SPSR & (1 << SPIF)))
+      ;
+    return SPDR;
+  }
+
+  // the next byte is started before the previous one is stored
+  static void read(uint8_t* data, uint16_t len) {
+    if (len == 0)
+      return;
+    SPDR = 0x00;
+    while (--len) {
+      while (!(SPSR & (1 << SPIF)))
+        ;
+      uint8_t nextbyte = SPDR;
+      SPDR = 0x00;
+      *data++ = nextbyte;
+    }
+    while (!(SPSR & (1 << SPIF)))
+      ;
+    *data = SPDR;
+  }
+
+  static void write(const uint8_t* data, uint16_t len) {
+    if (len == 0)
+      return;
+    SPDR = *data++;
+    while (--len) {
+      uint8_t nextbyte = *data++;
+      while (!(SPSR & (1 << SPIF)))
+        ;
+      SPDR = nextbyte;
+    }
+    while (!(SPSR & (1 << SPIF)))
+      ;
+  }
+};
+#endif
+
+/** Any Arduino SPIClass; the bus can be changed at run time with ENC28J60::initSPI(SPIClass*) */
+struct SpiClassBus {
+  static SPIClass* bus;
+  static SPISettings settings;
+
+  static void init();
+
+  static void setClock(uint32_t hz) {
+    settings = SPISettings(hz, MSBFIRST, SPI_MODE0);
+  }
+
+  static void useBus(SPIClass* spi);
+
+  static void begin() {
+    bus->beginTransaction(settings);
+  }
+
+  static void end() {
+    bus->endTransaction();
+  }
+
+  static uint8_t transfer(uint8_t data) {
+    return bus->transfer(data);
+  }
+
+#if defined(ESP32) || defined(ESP8266)
+  // The ESP SPI drivers move a whole block through the hardware FIFO in one
+  // call; the ENC28J60 ignores SI while streaming buffer memory out, so the
+  // dummy bytes clocked out during a read do not matter.
+  static void read(uint8_t* data, uint16_t len) {
+    bus->transferBytes(NULL, data, len);
+  }
+
+  static void write(const uint8_t* data, uint16_t len) {
+    bus->writeBytes(data, len);
+  }
+#else
+  static void read(uint8_t* data, uint16_t len) {
+    while (len--)
+      *data++ = bus->transfer(0x00);
+  }
+
+  static void write(const uint8_t* data, uint16_t len) {
+    while (len--)
+      bus->transfer(*data++);
+  }
+#endif
+};
+
+#ifndef ENC28J60_BUS
+#ifdef __AVR__
+#define ENC28J60_BUS AvrSpiBus
+#else
+#define ENC28J60_BUS SpiClassBus
+#endif
+#endif
+
+#endif
@@ -17,6 +17,11 @@
 #define HTTP_PORT 80
 #define DNS_PORT 53
 #define NTP_PORT 123
+#define DHCP_SERVER_PORT 67
+#define DHCP_CLIENT_PORT 68
+// high byte of the local ports used by the DNS and NTP clients
+#define DNSCLIENT_SRC_PORT_H 0xE0
+#define NTPCLIENT_SRC_PORT_H 10
 
 // ******* ETH *******
 #ifndef ETH_HEADER_LEN
@@ -76,8 +81,15 @@
 
 #define IP_PROTO_ICMP_V 1
 #define IP_PROTO_TCP_V 6
+#define IP_PROTO_IGMP_V 2
 // 17=0x11
 #define IP_PROTO_UDP_V 17
+// ******* IGMP *******
+#define IGMP_IP_HEADER_LEN 24  // IP header with Router Alert option
+#define IGMP_LEN 8
+#define IGMP_TYPE_QUERY_V 0x11
+#define IGMP_TYPE_REPORT_V 0x16  // IGMPv2 membership report
+#define IGMP_TYPE_LEAVE_V 0x17
 // ******* ICMP *******
 #define ICMP_TYPE_ECHOREPLY_V 0
 #define ICMP_TYPE_ECHOREQUEST_V 8
@@ -31,11 +31,24 @@ uint8_t Stash::fetchByte(uint8_t blk, uint8_t off) {
 }
 
 
+// the map and the cached write block belong to the selected controller, see
+// EtherCard::select(); the read block is dropped
+void Stash::switchState(EtherCardState& from, const EtherCardState& to) {
+  memcpy(from.stashMap, map, sizeof map);
+  memcpy(from.stashBlock, bufs[WRITEBUF].bytes, sizeof from.stashBlock);
+  from.stashBlockNum = bufs[WRITEBUF].bnum;
+  memcpy(map, to.stashMap, sizeof map);
+  memcpy(bufs[WRITEBUF].bytes, to.stashBlock, sizeof to.stashBlock);
+  bufs[WRITEBUF].bnum = to.stashBlockNum;
+  bufs[READBUF].bnum = 255;
+}
+
 // block 0 is special since always occupied
-void Stash::initMap(uint8_t last /*=SCRATCH_PAGE_NUM*/) {
-  last = SCRATCH_PAGE_NUM;
-  while (--last > 0)
-    freeBlock(last);
+void Stash::initMap() {
+  memset(map, 0, sizeof map);
+  uint8_t last = ENC28J60::scratchPages();
+  while (last > 1)
+    freeBlock(--last);
 }
 
 // load a page/block either into the write or into the readbuffer
@@ -204,8 +217,41 @@ uint16_t Stash::length() {
   return Stash::bufs[WRITEBUF].words[0];
 }
 
-void Stash::extract(uint16_t offset, uint16_t count, void* buf) {
-  Stash::load(WRITEBUF, 0);
+// output of the format walker: a host buffer for extract(), or the TX buffer
+// of the ENC28J60 for extractToEnc(), written over SPI in small chunks
+class StashSink {
+  char* out;
+  char chunk[32];
+  uint8_t fill;
+
+public:
+  StashSink(char* buf)
+    : out(buf), fill(0) {}
+
+  bool toEnc() const {
+    return out == NULL;
+  }
+
+  void put(char c) {
+    if (out) {
+      *out++ = c;
+      return;
+    }
+    chunk[fill++] = c;
+    if (fill == sizeof chunk)
+      flush();
+  }
+
+  void flush() {
+    if (fill)
+      ether.txPayloadWrite(chunk, fill);
+    fill = 0;
+  }
+};
+
+// expand the prepared format into the sink, skipping the first offset bytes
+void Stash::walk(uint16_t offset, uint16_t count, StashSink& sink) {
+  Stash::load(WRITEBUF, 0);  // also writes back a modified data block
   uint16_t* segs = Stash::bufs[WRITEBUF].words;
 #ifdef __AVR__
   PGM_P fmt = (PGM_P) * ++segs;
@@ -214,8 +260,9 @@ void Stash::extract(uint16_t offset, uint16_t count, void* buf) {
   segs += 2;
 #endif
   Stash stash;
-  char mode = '@', tmp[7], *ptr = NULL, *out = (char*)buf;
-  for (uint16_t i = 0; i < offset + count;) {
+  char mode = '@', tmp[7], *ptr = NULL;
+  uint16_t i = 0, end = offset + count;
+  while (i < end) {
     char c = 0;
     switch (mode) {
       case '@':
@@ -245,6 +292,12 @@ void Stash::extract(uint16_t offset, uint16_t count, void* buf) {
             case 'H':
               stash.open(arg);
               ptr = (char*)&stash;
+              if (sink.toEnc()) {
+                // the ENC28J60 copies the data blocks itself
+                sink.flush();
+                stash.copyToEnc(i, offset, end);
+                mode = '@';
+              }
               break;
           }
           continue;
@@ -270,11 +323,53 @@ void Stash::extract(uint16_t offset, uint16_t count, void* buf) {
       continue;
     }
     if (i >= offset)
-      *out++ = c;
+      sink.put(c);
     ++i;
   }
 }
 
+void Stash::extract(uint16_t offset, uint16_t count, void* buf) {
+  StashSink sink((char*)buf);
+  walk(offset, count, sink);
+}
+
+// let the ENC28J60 copy the data blocks in [from, to) into the TX buffer;
+// pos counts the extracted bytes so far
+void Stash::copyToEnc(uint16_t& pos, uint16_t from, uint16_t to) {
+  uint8_t blk = curr, off = offs;
+  for (;;) {
+    uint8_t end = blk == last ? fetchByte(blk, 62) : 63;
+    if (off < end) {
+      uint16_t n = end - off;
+      uint16_t skip = pos < from ? from - pos : 0;
+      if (skip < n && pos + skip < to) {
+        uint16_t take = n - skip;
+        if (take > to - pos - skip)
+          take = to - pos - skip;
+        ether.txPayloadCopy(blk, off + skip, take);
+      }
+      pos += n;
+    }
+    if (blk == last || pos >= to)
+      break;
+    blk = fetchByte(blk, 63);
+    off = 0;
+  }
+}
+
+// same as extract(), but the result goes straight into the TX buffer of the
+// ENC28J60 at frameOffset: formatted arguments are written over SPI, $H stashes
+// are copied on the chip; needs checksum offloading, returns false otherwise
+bool Stash::extractToEnc(uint16_t offset, uint16_t count, uint16_t frameOffset) {
+  if (!ether.isChecksumOffload())
+    return false;
+  ether.txPayloadBegin(frameOffset);
+  StashSink sink(NULL);
+  walk(offset, count, sink);
+  sink.flush();
+  return true;
+}
+
 void Stash::cleanup() {
   Stash::load(WRITEBUF, 0);
   uint16_t* segs = Stash::bufs[WRITEBUF].words;
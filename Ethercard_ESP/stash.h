@@ -3,6 +3,9 @@
 
 #include "EtherCard.h"
 
+class StashSink;
+struct EtherCardState;
+
 /** This structure describes the structure of memory used within the ENC28J60 network interface. */
 typedef struct
 {
@@ -35,14 +38,17 @@ class Stash : public /*Stream*/ Print, private StashHeader {
   static uint8_t allocBlock();
   static void freeBlock(uint8_t block);
   static uint8_t fetchByte(uint8_t blk, uint8_t off);
+  void copyToEnc(uint16_t& pos, uint16_t from, uint16_t to);
+  static void walk(uint16_t offset, uint16_t count, StashSink& sink);
 
   static Block bufs[2];
   static uint8_t map[SCRATCH_MAP_SIZE];
 
 public:
-  static void initMap(uint8_t last = SCRATCH_PAGE_NUM);
+  static void initMap();
   static void load(uint8_t idx, uint8_t blk);
   static uint8_t freeCount();
+  static void switchState(EtherCardState& from, const EtherCardState& to);
 
   Stash()
     : curr(0) {
@@ -69,6 +75,7 @@ public:
   static void prepare(const char* fmt PROGMEM, ...);
   static uint16_t length();
   static void extract(uint16_t offset, uint16_t count, void* buf);
+  static bool extractToEnc(uint16_t offset, uint16_t count, uint16_t frameOffset);
   static void cleanup();
 
   friend void dumpBlock(const char* msg, uint8_t idx);  // optional
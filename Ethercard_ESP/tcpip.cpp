@@ -62,6 +62,25 @@ static uint8_t result_fd = 123;  // Session id of last reply
 static const char *result_ptr;   // Pointer to TCP/IP data
 //static unsigned long SEQ; // TCP/IP sequence number
 
+#if ETHERCARD_IGMP
+static uint8_t groups[ETHERCARD_MAX_GROUPS][IP_LEN];  // joined multicast groups
+static uint8_t groupCount;
+#define IGMP_STATE(X) X(groups) X(groupCount)
+#else
+#define IGMP_STATE(X)
+#endif
+
+#define TCPIP_STATE(X) \
+  X(tcpclient_src_port_l) X(tcp_fd) X(tcp_client_state) X(tcp_client_port_h) X(tcp_client_port_l) \
+  X(client_tcp_result_cb) X(client_tcp_datafill_cb) X(www_fd) X(icmp_cb) X(destmacaddr) \
+  X(waiting_for_dns_mac) X(has_dns_mac) X(waiting_for_dest_mac) X(has_dest_mac) X(gwmacaddr) X(waitgwmac) \
+  X(info_data_len) X(seqnum) X(result_fd) X(result_ptr) IGMP_STATE(X)
+
+void EtherCard::stateTcpip(EtherCardState &from, const EtherCardState &to) {
+  TCPIP_STATE(ETHERCARD_SAVE_STATE)
+  TCPIP_STATE(ETHERCARD_LOAD_STATE)
+}
+
 #define CLIENTMSS 550
 #define TCP_DATA_START ((uint16_t)TCP_SRC_PORT_H_P + (gPB[TCP_HEADER_LEN_P] >> 4) * 4)  // Get offset of TCP/IP payload data
 
@@ -71,9 +90,19 @@ const unsigned char ntpreqhdr[] PROGMEM = { 0xE3, 0, 4, 0xFA, 0, 1, 0, 0, 0, 1 }
 extern const uint8_t allOnes[] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };           // Used for hardware (MAC) and IP broadcast addresses
 
 static void fill_checksum(uint8_t dest, uint8_t off, uint16_t len, uint8_t type) {
+  // the part of the pseudo header that is not in the range goes into the checksum
+  // field, so it is included whether the range is summed up here or by the ENC28J60
+  uint16_t seed = type == 1 ? IP_PROTO_UDP_V + len - 8 : type == 2 ? IP_PROTO_TCP_V + len - 8
+                                                                   : 0;
+  gPB[dest] = seed >> 8;
+  gPB[dest + 1] = seed;
+  if (EtherCard::queueChecksum(dest, off, len))
+    return;
+  // summing up here is only wrong if the payload is in the ENC28J60, and then
+  // packetSend() drops the frame
+
   const uint8_t *ptr = gPB + off;
-  uint32_t sum = type == 1 ? IP_PROTO_UDP_V + len - 8 : type == 2 ? IP_PROTO_TCP_V + len - 8
-                                                                  : 0;
+  uint32_t sum = 0;
   while (len > 1) {
     sum += (uint16_t)(((uint32_t)*ptr << 8) | *(ptr + 1));
     ptr += 2;
@@ -118,13 +147,85 @@ static uint8_t eth_type_is_arp_and_my_ip(uint16_t len) {
   return len >= 41 && gPB[ETH_TYPE_H_P] == ETHTYPE_ARP_H_V && gPB[ETH_TYPE_L_P] == ETHTYPE_ARP_L_V && memcmp(gPB + ETH_ARP_DST_IP_P, EtherCard::myip, IP_LEN) == 0;
 }
 
+// maps a multicast IP address to its MAC address (RFC 1112)
+static void multicast_mac(const uint8_t *ip, uint8_t *mac) {
+  mac[0] = 0x01;
+  mac[1] = 0x00;
+  mac[2] = 0x5E;
+  mac[3] = ip[1] & 0x7F;
+  mac[4] = ip[2];
+  mac[5] = ip[3];
+}
+
+#if ETHERCARD_IGMP
+static const uint8_t allHosts[IP_LEN] = { 224, 0, 0, 1 };
+static const uint8_t allRouters[IP_LEN] = { 224, 0, 0, 2 };
+
+static int8_t find_group(const uint8_t *ip) {
+  for (uint8_t i = 0; i < groupCount; ++i)
+    if (memcmp(groups[i], ip, IP_LEN) == 0)
+      return i;
+  return -1;
+}
+#endif
+
+static bool is_joined_group(const uint8_t *ip) {
+#if ETHERCARD_IGMP
+  return (ip[0] & 0xF0) == 0xE0 && find_group(ip) >= 0;
+#else
+  return false;
+#endif
+}
+
 static uint8_t eth_type_is_ip_and_my_ip(uint16_t len) {
   return len >= 42 && gPB[ETH_TYPE_H_P] == ETHTYPE_IP_H_V && gPB[ETH_TYPE_L_P] == ETHTYPE_IP_L_V && gPB[IP_HEADER_LEN_VER_P] == 0x45 &&  //Ethernet type
          (memcmp(gPB + IP_DST_P, EtherCard::myip, IP_LEN) == 0                                                                           // not my IP
           || (memcmp(gPB + IP_DST_P, EtherCard::broadcastip, IP_LEN) == 0)                                                               //not subnet broadcast
           || (memcmp(gPB + IP_DST_P, allOnes, IP_LEN) == 0)                                                                              //not global broadcasts
+          || is_joined_group(gPB + IP_DST_P)                                                                                              //not a joined multicast group
          );
-  //!@todo Handle multicast
+}
+
+#if ETHERCARD_IGMP
+// IGMP messages carry the Router Alert option, so they don't pass the check above
+static bool eth_type_is_igmp(uint16_t len) {
+  return len >= ETH_HEADER_LEN + IP_HEADER_LEN + IGMP_LEN && gPB[ETH_TYPE_H_P] == ETHTYPE_IP_H_V && gPB[ETH_TYPE_L_P] == ETHTYPE_IP_L_V && (gPB[IP_HEADER_LEN_VER_P] & 0xF0) == 0x40 && gPB[IP_PROTO_P] == IP_PROTO_IGMP_V;
+}
+#endif
+
+// Decides from the first ENC28J60_PEEK_LEN bytes of a frame whether packetLoop()
+// or one of the clients would look at it; everything else is dropped by
+// packetReceive() before its payload is copied over SPI
+static bool packet_is_for_us(uint16_t len) {
+  if (eth_type_is_arp_and_my_ip(len))
+    return true;
+#if ETHERCARD_IGMP
+  if (groupCount && eth_type_is_igmp(len))
+    return true;
+#endif
+  if (!eth_type_is_ip_and_my_ip(len)) {
+    // while DHCP is running offers may be addressed to the offered IP
+    return EtherCard::using_dhcp && len >= UDP_DATA_P && gPB[ETH_TYPE_H_P] == ETHTYPE_IP_H_V && gPB[ETH_TYPE_L_P] == ETHTYPE_IP_L_V && gPB[IP_PROTO_P] == IP_PROTO_UDP_V && gPB[UDP_DST_PORT_H_P] == 0 && gPB[UDP_DST_PORT_L_P] == DHCP_CLIENT_PORT;
+  }
+  switch (gPB[IP_PROTO_P]) {
+    case IP_PROTO_ICMP_V:
+    case IP_PROTO_TCP_V:
+      return true;
+    case IP_PROTO_UDP_V:
+      {
+        uint16_t port = (gPB[UDP_DST_PORT_H_P] << 8) | gPB[UDP_DST_PORT_L_P];
+        return EtherCard::udpServerListeningOnPort(port) || (EtherCard::using_dhcp && port == DHCP_CLIENT_PORT) || gPB[UDP_DST_PORT_H_P] == DNSCLIENT_SRC_PORT_H || gPB[UDP_DST_PORT_H_P] == NTPCLIENT_SRC_PORT_H;
+      }
+  }
+  return false;
+}
+
+void EtherCard::enableEarlyDrop() {
+  setPacketFilter(&packet_is_for_us);
+}
+
+void EtherCard::disableEarlyDrop() {
+  setPacketFilter(NULL);
 }
 
 static void fill_ip_hdr_checksum() {
@@ -317,7 +418,7 @@ void EtherCard::ntpRequest(uint8_t *ntpip, uint8_t srcport) {
   fill_ip_hdr_checksum();
   gPB[UDP_DST_PORT_H_P] = 0;
   gPB[UDP_DST_PORT_L_P] = NTP_PORT;  // ntp = 123
-  gPB[UDP_SRC_PORT_H_P] = 10;
+  gPB[UDP_SRC_PORT_H_P] = NTPCLIENT_SRC_PORT_H;
   gPB[UDP_SRC_PORT_L_P] = srcport;  // lower 8 bit of src port
   gPB[UDP_LEN_H_P] = 0;
   gPB[UDP_LEN_L_P] = 56;  // fixed len
@@ -347,7 +448,9 @@ void EtherCard::udpPrepare(uint16_t sport, const uint8_t *dip, uint16_t dport) {
   }
   // see http://tldp.org/HOWTO/Multicast-HOWTO-2.html
   // multicast or broadcast address, https://github.com/jcw/ethercard/issues/59
-  if ((dip[0] & 0xF0) == 0xE0 || *((unsigned long *)dip) == 0xFFFFFFFF || !memcmp(broadcastip, dip, IP_LEN))
+  if ((dip[0] & 0xF0) == 0xE0)
+    multicast_mac(dip, gPB + ETH_DST_MAC);
+  else if (*((unsigned long *)dip) == 0xFFFFFFFF || !memcmp(broadcastip, dip, IP_LEN))
     EtherCard::copyMac(gPB + ETH_DST_MAC, allOnes);
   gPB[ETH_TYPE_H_P] = ETHTYPE_IP_H_V;
   gPB[ETH_TYPE_L_P] = ETHTYPE_IP_L_V;
@@ -363,6 +466,81 @@ void EtherCard::udpPrepare(uint16_t sport, const uint8_t *dip, uint16_t dport) {
   gPB[UDP_CHECKSUM_L_P] = 0;
 }
 
+#if ETHERCARD_IGMP
+// sends an IGMPv2 message; the IP header has the Router Alert option (RFC 2236)
+static void send_igmp(uint8_t type, const uint8_t *group, const uint8_t *dip) {
+  uint8_t mac[ETH_LEN];
+  multicast_mac(dip, mac);
+  setMACs(mac);
+  gPB[ETH_TYPE_H_P] = ETHTYPE_IP_H_V;
+  gPB[ETH_TYPE_L_P] = ETHTYPE_IP_L_V;
+  uint8_t *ip = gPB + IP_P;
+  memset(ip, 0, IGMP_IP_HEADER_LEN + IGMP_LEN);
+  ip[0] = 0x40 | (IGMP_IP_HEADER_LEN >> 2);
+  ip[3] = IGMP_IP_HEADER_LEN + IGMP_LEN;
+  ip[8] = 1;  // TTL, IGMP stays on the local network
+  ip[9] = IP_PROTO_IGMP_V;
+  EtherCard::copyIp(ip + 12, EtherCard::myip);
+  EtherCard::copyIp(ip + 16, dip);
+  ip[20] = 0x94;  // Router Alert
+  ip[21] = 0x04;
+  fill_checksum(IP_CHECKSUM_P, IP_P, IGMP_IP_HEADER_LEN, 0);
+  uint8_t *igmp = ip + IGMP_IP_HEADER_LEN;
+  igmp[0] = type;
+  EtherCard::copyIp(igmp + 4, group);
+  fill_checksum(IP_P + IGMP_IP_HEADER_LEN + 2, IP_P + IGMP_IP_HEADER_LEN, IGMP_LEN, 0);
+  EtherCard::packetSend(ETH_HEADER_LEN + IGMP_IP_HEADER_LEN + IGMP_LEN);
+}
+
+// the hash table has to pass the joined groups and the all hosts group for queries
+static void program_multicast_filter() {
+  uint8_t macs[(ETHERCARD_MAX_GROUPS + 1) * ETH_LEN];
+  for (uint8_t i = 0; i < groupCount; ++i)
+    multicast_mac(groups[i], macs + i * ETH_LEN);
+  multicast_mac(allHosts, macs + groupCount * ETH_LEN);
+  EtherCard::setMulticastHash(macs, groupCount ? groupCount + 1 : 0);
+}
+
+// answers membership queries right away instead of after a random delay
+static void process_igmp() {
+  uint8_t *igmp = gPB + IP_P + ((gPB[IP_HEADER_LEN_VER_P] & 0x0F) << 2);
+  if (igmp[0] != IGMP_TYPE_QUERY_V)
+    return;
+  uint8_t group[IP_LEN];
+  EtherCard::copyIp(group, igmp + 4);
+  bool general = group[0] == 0;
+  if (!general && find_group(group) < 0)
+    return;
+  for (uint8_t i = 0; i < groupCount; ++i)
+    if (general || memcmp(groups[i], group, IP_LEN) == 0)
+      send_igmp(IGMP_TYPE_REPORT_V, groups[i], groups[i]);
+}
+
+bool EtherCard::joinGroup(const uint8_t *group) {
+  if ((group[0] & 0xF0) != 0xE0)
+    return false;
+  if (find_group(group) < 0) {
+    if (groupCount == ETHERCARD_MAX_GROUPS)
+      return false;
+    copyIp(groups[groupCount++], group);
+    program_multicast_filter();
+  }
+  send_igmp(IGMP_TYPE_REPORT_V, group, group);
+  return true;
+}
+
+bool EtherCard::leaveGroup(const uint8_t *group) {
+  int8_t i = find_group(group);
+  if (i < 0)
+    return false;
+  memmove(groups[i], groups[i + 1], (groupCount - i - 1) * IP_LEN);
+  --groupCount;
+  program_multicast_filter();
+  send_igmp(IGMP_TYPE_LEAVE_V, group, allRouters);
+  return true;
+}
+#endif
+
 void EtherCard::udpTransmit(uint16_t datalen) {
   gPB[IP_TOTLEN_H_P] = (IP_HEADER_LEN + UDP_HEADER_LEN + datalen) >> 8;
   gPB[IP_TOTLEN_L_P] = IP_HEADER_LEN + UDP_HEADER_LEN + datalen;
@@ -382,6 +560,58 @@ void EtherCard::sendUdp(const char *data, uint8_t datalen, uint16_t sport,
   udpTransmit(datalen);
 }
 
+#if ETHERCARD_CAPTURE
+// pcap fields go out in host order, readers tell it by the magic number
+static void put_pcap32(uint8_t *p, uint32_t v) {
+  memcpy(p, &v, 4);
+}
+
+uint8_t EtherCard::captureSend(const uint8_t *dip, uint16_t dport, uint16_t sport, bool header) {
+  CaptureRecord record;
+  const uint8_t *data = captureNext(record, false);
+  if (!data && !header)
+    return 0;
+  udpPrepare(sport, dip, dport);
+  uint8_t *start = gPB + UDP_DATA_P;
+  uint8_t *p = start;
+  uint8_t *end = gPB + (bufferSize < 1514 ? bufferSize : 1514);
+  // the file header and the record header with at least one byte must fit
+  if (end - start < (header ? 24 : 0) + (data ? 16 + 1 : 0))
+    return 0;
+  if (header) {
+    uint16_t version[2] = { 2, 4 };
+    put_pcap32(p, 0xA1B2C3D4);
+    memcpy(p + 4, version, 4);
+    memset(p + 8, 0, 8);
+    put_pcap32(p + 16, 0xFFFF);  // snap length
+    put_pcap32(p + 20, 1);       // Ethernet
+    p += 24;
+  }
+  uint8_t count = 0;
+  for (; data && count < 255; data = captureNext(record, false)) {
+    uint16_t capLen = record.capLen;
+    int16_t room = end - p - 16;
+    if (capLen > room) {
+      if (count || room < 1)
+        break;
+      capLen = room;  // clip a record that does not fit on its own
+    }
+    put_pcap32(p, record.timestamp / 1000000);
+    put_pcap32(p + 4, record.timestamp % 1000000);
+    put_pcap32(p + 8, capLen);
+    put_pcap32(p + 12, record.len);
+    memcpy(p + 16, data, capLen);
+    p += 16 + capLen;
+    captureNext(record);
+    ++count;
+  }
+  pauseCapture(true);  // would capture itself otherwise
+  udpTransmit(p - start);
+  pauseCapture(false);
+  return count;
+}
+#endif
+
 // make a arp request
 static void client_arp_whohas(uint8_t *ip_we_search) {
   setMACs(allOnes);
@@ -472,9 +702,12 @@ uint8_t EtherCard::clientTcpReq(uint8_t (*result_cb)(uint8_t, uint8_t, uint16_t,
 
 static uint16_t tcp_datafill_cb(uint8_t fd) {
   uint16_t len = Stash::length();
-  Stash::extract(0, len, EtherCard::tcpOffset());
+  // with checksum offloading the request is assembled in the ENC28J60 memory
+  bool inEnc = Stash::extractToEnc(0, len, EtherCard::tcpOffset() - gPB);
+  if (!inEnc)
+    Stash::extract(0, len, EtherCard::tcpOffset());
   Stash::cleanup();
-  EtherCard::tcpOffset()[len] = 0;
+  EtherCard::tcpOffset()[inEnc ? 0 : len] = 0;
 #if SERIAL
   DEBUG_PRINT("REQUEST: ");
   DEBUG_PRINT(len);
@@ -574,6 +807,7 @@ uint16_t EtherCard::packetLoop(uint16_t plen) {
   }
 
   if (eth_type_is_arp_and_my_ip(plen)) {  //Service ARP request
+    NETSTAT_INC(arp);
     if (gPB[ETH_ARP_OPCODE_L_P] == ETH_ARP_OPCODE_REQ_L_V)
       make_arp_answer_from_request();
     if (waitgwmac & WGW_ACCEPT_ARP_REPLY && (gPB[ETH_ARP_OPCODE_L_P] == ETH_ARP_OPCODE_REPLY_L_V) && client_store_mac(gwip, gwmacaddr))
@@ -589,8 +823,44 @@ uint16_t EtherCard::packetLoop(uint16_t plen) {
     return 0;
   }
 
+#if ETHERCARD_IGMP
+  if (groupCount && eth_type_is_igmp(plen)) {  //Answer membership queries for joined groups
+    process_igmp();
+    return 0;
+  }
+#endif
+
   if (eth_type_is_ip_and_my_ip(plen) == 0) {  //Not IP so ignoring
     //!@todo Add other protocols (and make each optional at compile time)
+    if ((gPB[ETH_TYPE_H_P] == ETHTYPE_IP_H_V && gPB[ETH_TYPE_L_P] == ETHTYPE_IP_L_V) || (gPB[ETH_TYPE_H_P] == ETHTYPE_ARP_H_V && gPB[ETH_TYPE_L_P] == ETHTYPE_ARP_L_V))
+      NETSTAT_DROP(rxNotForUs);
+    else
+      NETSTAT_DROP(rxUnhandled);
+    return 0;
+  }
+
+  // only counts, the protocol checks below drop what nobody handles
+  switch (gPB[IP_PROTO_P]) {
+    case IP_PROTO_ICMP_V:
+      NETSTAT_INC(icmp);
+      break;
+    case IP_PROTO_UDP_V:
+      NETSTAT_INC(udp);
+      break;
+    case IP_PROTO_TCP_V:
+      NETSTAT_INC(tcp);
+      break;
+    default:
+      NETSTAT_DROP(rxUnhandled);
+      break;
+  }
+
+  // multicast is only for the UDP listeners
+  if (is_joined_group(gPB + IP_DST_P)) {
+#if ETHERCARD_UDPSERVER
+    if (ether.udpServerListening() && gPB[IP_PROTO_P] == IP_PROTO_UDP_V)
+      ether.udpServerHasProcessedPacket(plen);
+#endif
     return 0;
   }
 
@@ -683,6 +953,18 @@ uint16_t EtherCard::packetLoop(uint16_t plen) {
 #endif
 }
 
+uint16_t EtherCard::packetLoop(const PacketDescriptor &pkt) {
+  uint16_t len = pkt.len;
+  if (pkt.data != gPB) {
+    if (len > bufferSize - 1)
+      len = bufferSize - 1;
+    memcpy(gPB, pkt.data, len);
+    gPB[len] = 0;
+  }
+  received_tagged = pkt.tagged;
+  return packetLoop(len);
+}
+
 void EtherCard::persistTcpConnection(bool persist) {
   persist_tcp_connection = persist;
 }
@@ -10,17 +10,16 @@
 
 #define gPB ether.buffer
 
-#define UDPSERVER_MAXLISTENERS 8  //the maximum number of port listeners.
-
-typedef struct {
-  UdpServerCallback callback;
-  uint16_t port;
-  bool listening;
-} UdpServerListener;
-
 UdpServerListener listeners[UDPSERVER_MAXLISTENERS];
 byte numListeners = 0;
 
+#define UDPSERVER_STATE(X) X(listeners) X(numListeners)
+
+void EtherCard::stateUdpServer(EtherCardState &from, const EtherCardState &to) {
+  UDPSERVER_STATE(ETHERCARD_SAVE_STATE)
+  UDPSERVER_STATE(ETHERCARD_LOAD_STATE)
+}
+
 void EtherCard::udpServerListenOnPort(UdpServerCallback callback, uint16_t port) {
   if (numListeners < UDPSERVER_MAXLISTENERS) {
     listeners[numListeners] = (UdpServerListener){
@@ -50,6 +49,14 @@ bool EtherCard::udpServerListening() {
   return numListeners > 0;
 }
 
+bool EtherCard::udpServerListeningOnPort(uint16_t port) {
+  for (int i = 0; i < numListeners; i++) {
+    if (listeners[i].port == port && listeners[i].listening)
+      return true;
+  }
+  return false;
+}
+
 bool EtherCard::udpServerHasProcessedPacket(uint16_t plen) {
   bool packetProcessed = false;
   for (int i = 0; i < numListeners; i++) {
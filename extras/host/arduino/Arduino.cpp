@@ -0,0 +1,208 @@
+// Minimal Arduino core for running the EtherCard sources on a Linux host
+// Copyright: GPL V2
+
+#include "Arduino.h"
+#include "SPI.h"
+#include <time.h>
+
+HardwareSerial Serial;
+SPIClass SPI;
+
+struct HostPin {
+  uint8_t level;
+  uint8_t mode;
+  void (*isr)();
+  int isrMode;
+  HostPinWatcher watcher;
+  void* context;
+};
+
+static HostPin pins[HOST_PINS];
+static bool virtualTime = false;
+static uint64_t virtualMicros;
+
+static HostPin* pinAt(uint8_t pin) {
+  return pin < HOST_PINS ? &pins[pin] : NULL;
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+  HostPin* p = pinAt(pin);
+  if (p == NULL)
+    return;
+  p->mode = mode;
+  if (mode == INPUT_PULLUP && p->watcher == NULL)
+    p->level = HIGH;
+}
+
+void digitalWrite(uint8_t pin, uint8_t level) {
+  HostPin* p = pinAt(pin);
+  if (p == NULL)
+    return;
+  p->level = level ? HIGH : LOW;
+  if (p->watcher)
+    p->watcher(p->context, pin, p->level);
+}
+
+int digitalRead(uint8_t pin) {
+  HostPin* p = pinAt(pin);
+  return p ? p->level : LOW;
+}
+
+void attachInterrupt(uint8_t interrupt, void (*isr)(), int mode) {
+  HostPin* p = pinAt(interrupt);
+  if (p == NULL)
+    return;
+  p->isr = isr;
+  p->isrMode = mode;
+}
+
+void detachInterrupt(uint8_t interrupt) {
+  HostPin* p = pinAt(interrupt);
+  if (p)
+    p->isr = NULL;
+}
+
+void noInterrupts() {}
+
+void interrupts() {}
+
+void hostWatchPin(uint8_t pin, HostPinWatcher watcher, void* context) {
+  HostPin* p = pinAt(pin);
+  if (p == NULL)
+    return;
+  p->watcher = watcher;
+  p->context = context;
+}
+
+void hostSetPin(uint8_t pin, uint8_t level) {
+  HostPin* p = pinAt(pin);
+  if (p == NULL)
+    return;
+  uint8_t old = p->level;
+  p->level = level ? HIGH : LOW;
+  if (p->isr == NULL || old == p->level)
+    return;
+  if (p->isrMode == CHANGE || (p->isrMode == FALLING && p->level == LOW) || (p->isrMode == RISING && p->level == HIGH))
+    p->isr();
+}
+
+static uint64_t hostMicros() {
+  if (virtualTime)
+    return virtualMicros;
+  static uint64_t start = 0;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t now = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  if (start == 0)
+    start = now;
+  return now - start;
+}
+
+void hostUseVirtualTime(bool enable) {
+  virtualMicros = hostMicros();
+  virtualTime = enable;
+}
+
+void hostAdvanceMicros(uint64_t us) {
+  virtualMicros += us;
+}
+
+unsigned long millis() {
+  return hostMicros() / 1000;
+}
+
+unsigned long micros() {
+  return hostMicros();
+}
+
+void delayMicroseconds(unsigned int us) {
+  if (virtualTime) {
+    virtualMicros += us;
+    return;
+  }
+  struct timespec ts = { (time_t)(us / 1000000), (long)(us % 1000000) * 1000 };
+  nanosleep(&ts, NULL);
+}
+
+void delay(unsigned long ms) {
+  while (ms--)
+    delayMicroseconds(1000);
+}
+
+void yield() {}
+
+char* ultoa(unsigned long value, char* str, int base) {
+  char tmp[sizeof(unsigned long) * 8 + 1];
+  char* p = tmp;
+  do {
+    unsigned digit = value % base;
+    *p++ = digit < 10 ? '0' + digit : 'a' + digit - 10;
+    value /= base;
+  } while (value);
+  char* out = str;
+  while (p > tmp)
+    *out++ = *--p;
+  *out = 0;
+  return str;
+}
+
+char* ltoa(long value, char* str, int base) {
+  if (value < 0 && base == 10) {
+    *str = '-';
+    ultoa(-(unsigned long)value, str + 1, base);
+    return str;
+  }
+  return ultoa((unsigned long)value, str, base);
+}
+
+char* itoa(int value, char* str, int base) {
+  return ltoa(value, str, base);
+}
+
+char* dtostrf(double value, signed char width, unsigned char prec, char* str) {
+  sprintf(str, "%*.*f", width, prec, value);
+  return str;
+}
+
+size_t Print::write(const uint8_t* buffer, size_t size) {
+  size_t n = 0;
+  while (size--)
+    n += write(*buffer++);
+  return n;
+}
+
+size_t Print::write(const char* str) {
+  return str ? write((const uint8_t*)str, strlen(str)) : 0;
+}
+
+size_t Print::print(const char* str) {
+  return write(str);
+}
+
+size_t Print::print(const String& str) {
+  return write(str.c_str());
+}
+
+size_t Print::print(char c) {
+  return write((uint8_t)c);
+}
+
+size_t Print::print(long value, int base) {
+  char buf[sizeof(long) * 8 + 2];
+  return write(ltoa(value, buf, base));
+}
+
+size_t Print::print(unsigned long value, int base) {
+  char buf[sizeof(long) * 8 + 1];
+  return write(ultoa(value, buf, base));
+}
+
+size_t Print::print(double value, int digits) {
+  char buf[64];
+  snprintf(buf, sizeof buf, "%.*f", digits, value);
+  return write(buf);
+}
+
+size_t Print::println() {
+  return write("\r\n");
+}
@@ -0,0 +1,126 @@
+// Minimal Arduino core for running the EtherCard sources on a Linux host
+// Copyright: GPL V2
+//
+// Only what the library itself uses is provided. Pins are plain levels in
+// memory; device models hook into them with hostWatchPin() and drive inputs
+// with hostSetPin(), which also runs interrupts attached to the pin.
+
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <string>
+
+typedef uint8_t byte;
+typedef uint16_t word;
+typedef bool boolean;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+
+#define bit(b) (1UL << (b))
+#define bitRead(value, b) (((value) >> (b)) & 1)
+#define bitSet(value, b) ((value) |= (1UL << (b)))
+#define bitClear(value, b) ((value) &= ~(1UL << (b)))
+#define lowByte(w) ((uint8_t)((w) & 0xff))
+#define highByte(w) ((uint8_t)((w) >> 8))
+
+#define digitalPinToInterrupt(p) (p)
+
+#include "pgmspace.h"
+
+#define HOST_PINS 64
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t level);
+int digitalRead(uint8_t pin);
+void attachInterrupt(uint8_t interrupt, void (*isr)(), int mode);
+void detachInterrupt(uint8_t interrupt);
+void noInterrupts();
+void interrupts();
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+
+char* ltoa(long value, char* str, int base);
+char* ultoa(unsigned long value, char* str, int base);
+char* itoa(int value, char* str, int base);
+char* dtostrf(double value, signed char width, unsigned char prec, char* str);
+
+/** Called with the new level whenever the sketch writes the pin */
+typedef void (*HostPinWatcher)(void* context, uint8_t pin, uint8_t level);
+
+/** Register a watcher for writes to pin, one per pin */
+void hostWatchPin(uint8_t pin, HostPinWatcher watcher, void* context);
+
+/** Drive an input pin from a device model and run an attached interrupt on a matching edge */
+void hostSetPin(uint8_t pin, uint8_t level);
+
+/** Let millis() and micros() follow a virtual clock instead of the host clock */
+void hostUseVirtualTime(bool enable);
+
+/** Move the virtual clock forward */
+void hostAdvanceMicros(uint64_t us);
+
+#include "Print.h"
+
+class String {
+public:
+  String(const char* s = "") : s_(s ? s : "") {}
+  String(int value) : s_(std::to_string(value)) {}
+  String(unsigned value) : s_(std::to_string(value)) {}
+  String(long value) : s_(std::to_string(value)) {}
+  String(unsigned long value) : s_(std::to_string(value)) {}
+  String(uint8_t value) : s_(std::to_string(value)) {}
+  String(char c) : s_(1, c) {}
+
+  String& operator+=(const String& rhs) {
+    s_ += rhs.s_;
+    return *this;
+  }
+  friend String operator+(String lhs, const String& rhs) {
+    lhs += rhs;
+    return lhs;
+  }
+  bool operator==(const String& rhs) const {
+    return s_ == rhs.s_;
+  }
+
+  const char* c_str() const {
+    return s_.c_str();
+  }
+  unsigned int length() const {
+    return s_.length();
+  }
+
+private:
+  std::string s_;
+};
+
+class HardwareSerial : public Print {
+public:
+  void begin(unsigned long) {}
+  size_t write(uint8_t c) {
+    return fputc(c, stdout) == EOF ? 0 : 1;
+  }
+  using Print::write;
+};
+
+extern HardwareSerial Serial;
+
+#endif
@@ -0,0 +1,35 @@
+// SPI class for the host build; bytes go nowhere unless a bus policy routes them
+// to a device model (see host_spi_bus.h)
+// Copyright: GPL V2
+
+#ifndef HOST_SPI_H
+#define HOST_SPI_H
+
+#include <stdint.h>
+
+#define MSBFIRST 1
+#define LSBFIRST 0
+#define SPI_MODE0 0
+
+class SPISettings {
+public:
+  SPISettings() {}
+  SPISettings(uint32_t clock, uint8_t /* bitOrder */, uint8_t /* dataMode */) : clock(clock) {}
+  uint32_t clock = 0;
+};
+
+class SPIClass {
+public:
+  void begin() {}
+  void end() {}
+  void setBitOrder(uint8_t) {}
+  void beginTransaction(SPISettings) {}
+  void endTransaction() {}
+  uint8_t transfer(uint8_t) {
+    return 0xFF;
+  }
+};
+
+extern SPIClass SPI;
+
+#endif
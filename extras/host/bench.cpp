@@ -0,0 +1,100 @@
+// Runs the EtherCard stack against Enc28j60Model on the host and measures how
+// many ICMP echo requests per second packetLoop() answers, see README.md
+// Copyright: GPL V2
+
+#include <EtherCard.h>
+#include <stdio.h>
+#include <time.h>
+#include "enc28j60_model.h"
+
+byte Ethernet::buffer[700];
+
+static const byte mymac[] = { 0x74, 0x69, 0x69, 0x2D, 0x30, 0x31 };
+static const byte myip[] = { 192, 168, 1, 203 };
+static const byte gwip[] = { 192, 168, 1, 1 };
+static const byte peermac[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+static const byte peerip[] = { 192, 168, 1, 10 };
+
+static uint32_t replies;
+
+static void onTransmit(void* /* context */, const uint8_t* frame, uint16_t len) {
+  if (len >= 35 && frame[23] == 1 && frame[34] == 0)  // ICMP echo reply
+    ++replies;
+}
+
+static uint16_t checksum(const byte* data, uint16_t len) {
+  uint32_t sum = 0;
+  for (; len > 1; len -= 2, data += 2)
+    sum += data[0] << 8 | data[1];
+  if (len)
+    sum += data[0] << 8;
+  while (sum >> 16)
+    sum = (uint16_t)sum + (sum >> 16);
+  return ~sum;
+}
+
+// Ethernet, IPv4 and ICMP echo request with payload bytes of data
+static uint16_t makePing(byte* frame, uint16_t payload, uint16_t seq) {
+  uint16_t ipLen = 20 + 8 + payload;
+  memset(frame, 0, 14 + ipLen);
+  memcpy(frame, mymac, 6);
+  memcpy(frame + 6, peermac, 6);
+  frame[12] = 0x08;
+  byte* ip = frame + 14;
+  ip[0] = 0x45;
+  ip[2] = ipLen >> 8;
+  ip[3] = ipLen;
+  ip[8] = 64;
+  ip[9] = 1;
+  memcpy(ip + 12, peerip, 4);
+  memcpy(ip + 16, myip, 4);
+  uint16_t ck = checksum(ip, 20);
+  ip[10] = ck >> 8;
+  ip[11] = ck;
+  byte* icmp = ip + 20;
+  icmp[0] = 8;
+  icmp[6] = seq >> 8;
+  icmp[7] = seq;
+  for (uint16_t i = 0; i < payload; ++i)
+    icmp[8 + i] = i;
+  ck = checksum(icmp, 8 + payload);
+  icmp[2] = ck >> 8;
+  icmp[3] = ck;
+  return 14 + ipLen;
+}
+
+static double seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv) {
+  uint32_t count = argc > 1 ? strtoul(argv[1], NULL, 0) : 100000;
+  uint16_t payload = argc > 2 ? strtoul(argv[2], NULL, 0) : 56;
+
+  Enc28j60Model nic(ENC28J60_CS_PIN);
+  nic.setTransmitHandler(onTransmit, NULL);
+  if (ether.begin(sizeof Ethernet::buffer, mymac) == 0) {
+    printf("ENC28J60 model not found\n");
+    return 1;
+  }
+  ether.staticSetup(myip, gwip);
+
+  byte frame[1514];
+  uint16_t len = makePing(frame, payload, 0);
+  ENC28J60::resetStats();
+  double start = seconds();
+  for (uint32_t n = 0; n < count; ++n) {
+    nic.receive(frame, len);
+    ether.packetLoop(ether.packetReceive());
+  }
+  double elapsed = seconds() - start;
+
+  NetStats stats;
+  ENC28J60::getStats(stats);
+  printf("%u pings of %u bytes, %u replies in %.3f s: %.0f packets/s, %u SPI bytes per ping\n",
+         (unsigned)count, (unsigned)len, (unsigned)replies, elapsed, count / elapsed,
+         (unsigned)(count ? stats.spiBytes / count : 0));
+  return replies == count ? 0 : 1;
+}
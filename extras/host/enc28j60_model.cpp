@@ -0,0 +1,567 @@
+// Software model of the Microchip ENC28J60 for host builds
+// Copyright: GPL V2
+
+#include "enc28j60_model.h"
+#include <Arduino.h>
+
+// registers by bank << 5 | address, the common ones by address only
+#define ERDPT    0x00
+#define EWRPT    0x02
+#define ETXST    0x04
+#define ETXND    0x06
+#define ERXST    0x08
+#define ERXND    0x0A
+#define ERXRDPT  0x0C
+#define ERXWRPT  0x0E
+#define EDMAST   0x10
+#define EDMAND   0x12
+#define EDMADST  0x14
+#define EDMACS   0x16
+#define EIE      0x1B
+#define EIR      0x1C
+#define ESTAT    0x1D
+#define ECON2    0x1E
+#define ECON1    0x1F
+#define EHT0     0x20
+#define EPMM0    0x28
+#define EPMCS    0x30
+#define EPMO     0x34
+#define ERXFCON  0x38
+#define EPKTCNT  0x39
+#define MACON3   0x42
+#define MICMD    0x52
+#define MIREGADR 0x54
+#define MIWR     0x56
+#define MIRD     0x58
+#define MAADR1   0x60
+#define MAADR0   0x61
+#define MAADR3   0x62
+#define MAADR2   0x63
+#define MAADR5   0x64
+#define MAADR4   0x65
+#define EBSTSD   0x66
+#define EBSTCON  0x67
+#define EBSTCS   0x68
+#define MISTAT   0x6A
+#define EREVID   0x72
+
+#define ERXFCON_UCEN  0x80
+#define ERXFCON_ANDOR 0x40
+#define ERXFCON_PMEN  0x10
+#define ERXFCON_HTEN  0x04
+#define ERXFCON_MCEN  0x02
+#define ERXFCON_BCEN  0x01
+#define EIR_PKTIF  0x40
+#define EIR_DMAIF  0x20
+#define EIR_LINKIF 0x10
+#define EIR_TXIF   0x08
+#define EIR_RXERIF 0x01
+#define EIE_INTIE  0x80
+#define ESTAT_INT    0x80
+#define ESTAT_CLKRDY 0x01
+#define ECON2_AUTOINC 0x80
+#define ECON2_PKTDEC  0x40
+#define ECON1_DMAST  0x20
+#define ECON1_CSUMEN 0x10
+#define ECON1_TXRTS  0x08
+#define ECON1_RXEN   0x04
+#define MACON3_PADCFG0 0x20
+#define MICMD_MIISCAN 0x02
+#define MISTAT_NVALID 0x04
+#define MICMD_MIIRD   0x01
+#define EBSTCON_TMSEL 0x0C
+#define EBSTCON_TME     0x02
+#define EBSTCON_BISTST  0x01
+#define PKTCTRL_PPADEN    0x04
+#define PKTCTRL_POVERRIDE 0x01
+
+#define PHCON1  0x00
+#define PHSTAT1 0x01
+#define PHHID1  0x02
+#define PHHID2  0x03
+#define PHCON2  0x10
+#define PHSTAT2 0x11
+#define PHIE    0x12
+#define PHIR    0x13
+#define PHLCON  0x14
+#define PHCON1_PDPXMD  0x0100
+#define PHSTAT1_LLSTAT 0x0004
+#define PHSTAT2_LSTAT  0x0400
+#define PHSTAT2_DPXSTAT 0x0200
+#define PHIE_PLNKIE 0x0010
+#define PHIE_PGEIE  0x0002
+#define PHIR_PLNKIF 0x0010
+#define PHIR_PGIF   0x0004
+
+#define REVISION_B7 0x06
+#define MIN_FRAME 60
+
+Enc28j60Model* Enc28j60Model::active = NULL;
+
+// Ethernet FCS, appended to received frames like the MAC does
+static uint32_t crc32(const uint8_t* data, uint16_t len) {
+  uint32_t crc = 0xFFFFFFFF;
+  while (len--) {
+    crc ^= *data++;
+    for (uint8_t i = 0; i < 8; ++i)
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+  }
+  return ~crc;
+}
+
+// the hash table pointer: bits 28:23 of the CRC as the MAC shifts it
+static uint8_t hashPointer(const uint8_t* mac) {
+  uint32_t crc = 0xFFFFFFFF;
+  for (uint8_t i = 0; i < 6; ++i) {
+    uint8_t b = mac[i];
+    for (uint8_t j = 0; j < 8; ++j, b >>= 1) {
+      bool bit = ((crc >> 31) ^ b) & 1;
+      crc <<= 1;
+      if (bit)
+        crc ^= 0x04C11DB7;
+    }
+  }
+  return (crc >> 23) & 0x3F;
+}
+
+static uint16_t fold(uint32_t sum) {
+  while (sum >> 16)
+    sum = (uint16_t)sum + (sum >> 16);
+  return sum;
+}
+
+Enc28j60Model::Enc28j60Model(uint8_t csPin, uint8_t intPin)
+  : csPin(csPin), intPin(intPin), linkUp(true), overflows(0), filtered(0), transmitted(0), txHandler(NULL), txContext(NULL) {
+  memset(mem, 0, sizeof mem);
+  reset();
+  hostWatchPin(csPin, chipSelect, this);
+}
+
+Enc28j60Model::~Enc28j60Model() {
+  hostWatchPin(csPin, NULL, NULL);
+  if (active == this)
+    active = NULL;
+}
+
+void Enc28j60Model::reset() {
+  state = IDLE;
+  scanning = false;
+  memset(regs, 0, sizeof regs);
+  memset(phy, 0, sizeof phy);
+  setReg16(ERDPT, 0x05FA);
+  setReg16(ERXND, 0x1FFF);
+  setReg16(ERXRDPT, 0x05FA);
+  regs[ERXFCON] = 0xA1;
+  regs[ECON2] = ECON2_AUTOINC;
+  regs[ESTAT] = ESTAT_CLKRDY;
+  regs[EREVID] = REVISION_B7;
+  phy[PHSTAT1] = 0x1800;
+  phy[PHHID1] = 0x0083;
+  phy[PHHID2] = 0x1400;
+  phy[PHLCON] = 0x3422;
+  setLink(linkUp);
+  phy[PHIR] = 0;
+  regs[EIR] = 0;
+  updateInt();
+}
+
+void Enc28j60Model::setTransmitHandler(TransmitHandler handler, void* context) {
+  txHandler = handler;
+  txContext = context;
+}
+
+void Enc28j60Model::setLink(bool up) {
+  bool changed = up != linkUp;
+  linkUp = up;
+  if (up)
+    phy[PHSTAT2] |= PHSTAT2_LSTAT;
+  else {
+    phy[PHSTAT2] &= ~PHSTAT2_LSTAT;
+    phy[PHSTAT1] &= ~PHSTAT1_LLSTAT;  // latches low
+  }
+  if (!changed)
+    return;
+  phy[PHIR] |= PHIR_PGIF | PHIR_PLNKIF;
+  if ((phy[PHIE] & (PHIE_PGEIE | PHIE_PLNKIE)) == (PHIE_PGEIE | PHIE_PLNKIE))
+    regs[EIR] |= EIR_LINKIF;
+  updateInt();
+}
+
+uint8_t Enc28j60Model::packetCount() const {
+  return regs[EPKTCNT];
+}
+
+void Enc28j60Model::chipSelect(void* context, uint8_t /* pin */, uint8_t level) {
+  Enc28j60Model* chip = (Enc28j60Model*)context;
+  if (level == LOW) {
+    active = chip;
+    chip->state = OPCODE;
+  } else {
+    if (active == chip)
+      active = NULL;
+    chip->state = IDLE;
+    chip->updateInt();
+  }
+}
+
+uint8_t Enc28j60Model::key(uint8_t address) const {
+  address &= 0x1F;
+  if (address >= EIE)
+    return address;
+  return ((regs[ECON1] & 0x03) << 5) | address;
+}
+
+uint16_t Enc28j60Model::reg16(uint8_t key) const {
+  return (regs[key] | regs[key + 1] << 8) & 0x1FFF;
+}
+
+void Enc28j60Model::setReg16(uint8_t key, uint16_t value) {
+  regs[key] = value;
+  regs[key + 1] = value >> 8;
+}
+
+uint16_t Enc28j60Model::ringNext(uint16_t addr) const {
+  return addr == reg16(ERXND) ? reg16(ERXST) : (addr + 1) & 0x1FFF;
+}
+
+uint8_t Enc28j60Model::transfer(uint8_t data) {
+  uint8_t out = 0;
+  switch (state) {
+    case OPCODE:
+      arg = data & 0x1F;
+      state = DONE;
+      if (data == 0xFF) {
+        reset();
+        state = DONE;
+      } else if (data == 0x3A)
+        state = READ_BUF;
+      else if (data == 0x7A)
+        state = WRITE_BUF;
+      else if ((data & 0xE0) == 0x00)
+        state = READ_CTRL;
+      else if ((data & 0xE0) == 0x40)
+        state = WRITE_CTRL;
+      else if ((data & 0xE0) == 0x80)
+        state = SET_BITS;
+      else if ((data & 0xE0) == 0xA0)
+        state = CLEAR_BITS;
+      break;
+    case READ_CTRL:
+      out = readReg(arg);  // also answers the dummy byte of MAC and MII registers
+      break;
+    case WRITE_CTRL:
+      writeReg(arg, data);
+      state = DONE;
+      break;
+    case SET_BITS:
+      writeReg(arg, regs[key(arg)] | data);
+      state = DONE;
+      break;
+    case CLEAR_BITS:
+      writeReg(arg, regs[key(arg)] & ~data);
+      state = DONE;
+      break;
+    case READ_BUF: {
+      uint16_t addr = reg16(ERDPT);
+      out = mem[addr];
+      if (regs[ECON2] & ECON2_AUTOINC)
+        setReg16(ERDPT, ringNext(addr));
+      break;
+    }
+    case WRITE_BUF: {
+      uint16_t addr = reg16(EWRPT);
+      mem[addr] = data;
+      if (regs[ECON2] & ECON2_AUTOINC)
+        setReg16(EWRPT, (addr + 1) & 0x1FFF);
+      break;
+    }
+    default:
+      break;
+  }
+  return out;
+}
+
+uint8_t Enc28j60Model::readReg(uint8_t address) {
+  uint8_t k = key(address);
+  switch (k) {
+    case MIRD:
+    case MIRD + 1:
+      // MIRD keeps the old value until the first scan cycle has finished
+      if (scanning && !(regs[MISTAT] & MISTAT_NVALID))
+        setReg16(MIRD, readPhy(regs[MIREGADR]));
+      break;
+    case MISTAT:
+      // one MII cycle passes between starting a scan and polling NVALID
+      if (regs[MISTAT] & MISTAT_NVALID) {
+        setReg16(MIRD, readPhy(regs[MIREGADR]));
+        regs[MISTAT] &= ~MISTAT_NVALID;
+      }
+      break;
+    case ESTAT:
+      regs[ESTAT] = (regs[ESTAT] & ~ESTAT_INT) | ESTAT_CLKRDY;
+      if (regs[EIR] & regs[EIE] & 0x7B)
+        regs[ESTAT] |= ESTAT_INT;
+      break;
+  }
+  return regs[k];
+}
+
+void Enc28j60Model::writeReg(uint8_t address, uint8_t value) {
+  uint8_t k = key(address);
+  uint8_t old = regs[k];
+  switch (k) {
+    case ESTAT:
+    case EPKTCNT:
+    case EREVID:
+    case MISTAT:
+    case ERXWRPT:
+    case ERXWRPT + 1:
+      return;  // read only
+    case ECON2:
+      if (value & ECON2_PKTDEC) {
+        if (regs[EPKTCNT])
+          --regs[EPKTCNT];
+        if (regs[EPKTCNT] == 0)
+          regs[EIR] &= ~EIR_PKTIF;
+        value &= ~ECON2_PKTDEC;
+      }
+      break;
+    case EIR:
+      // PKTIF and LINKIF follow EPKTCNT and PHIR
+      value = (value & ~(EIR_PKTIF | EIR_LINKIF)) | (old & (EIR_PKTIF | EIR_LINKIF));
+      break;
+  }
+  regs[k] = value;
+
+  switch (k) {
+    case ERXST:
+    case ERXST + 1:
+      setReg16(ERXWRPT, reg16(ERXST));
+      break;
+    case ECON1:
+      if ((value & ECON1_DMAST) && !(old & ECON1_DMAST))
+        runDma();
+      if ((value & ECON1_TXRTS) && !(old & ECON1_TXRTS))
+        transmit();
+      break;
+    case MICMD:
+      scanning = value & MICMD_MIISCAN;
+      if (scanning && !(old & MICMD_MIISCAN))
+        regs[MISTAT] |= MISTAT_NVALID;
+      else if (!scanning)
+        regs[MISTAT] &= ~MISTAT_NVALID;
+      if ((value & MICMD_MIIRD) && !(old & MICMD_MIIRD))
+        setReg16(MIRD, readPhy(regs[MIREGADR]));
+      break;
+    case MIWR + 1:
+      writePhy(regs[MIREGADR], regs[MIWR] | regs[MIWR + 1] << 8);
+      break;
+    case EBSTCON:
+      if ((value & (EBSTCON_TME | EBSTCON_BISTST)) == (EBSTCON_TME | EBSTCON_BISTST))
+        runBist(value & EBSTCON_TMSEL);
+      break;
+  }
+}
+
+uint16_t Enc28j60Model::readPhy(uint8_t address) {
+  address &= 0x1F;
+  uint16_t value = phy[address];
+  switch (address) {
+    case PHSTAT1:
+      if (linkUp)
+        phy[PHSTAT1] |= PHSTAT1_LLSTAT;  // latched low until read
+      break;
+    case PHIR:
+      phy[PHIR] = 0;
+      regs[EIR] &= ~EIR_LINKIF;
+      updateInt();
+      break;
+  }
+  return value;
+}
+
+void Enc28j60Model::writePhy(uint8_t address, uint16_t value) {
+  address &= 0x1F;
+  switch (address) {
+    case PHSTAT1:
+    case PHSTAT2:
+    case PHHID1:
+    case PHHID2:
+    case PHIR:
+      return;  // read only
+    case PHCON1:
+      if (value & PHCON1_PDPXMD)
+        phy[PHSTAT2] |= PHSTAT2_DPXSTAT;
+      else
+        phy[PHSTAT2] &= ~PHSTAT2_DPXSTAT;
+      break;
+  }
+  phy[address] = value;
+}
+
+// IP style checksum over first..last, following the RX ring wrap if asked to
+uint16_t Enc28j60Model::checksum(uint16_t first, uint16_t last, bool wrap) const {
+  uint32_t sum = 0;
+  bool high = true;
+  for (uint16_t addr = first;; addr = wrap ? ringNext(addr) : (addr + 1) & 0x1FFF) {
+    sum += high ? mem[addr] << 8 : mem[addr];
+    high = !high;
+    if (addr == last)
+      break;
+  }
+  return ~fold(sum);
+}
+
+void Enc28j60Model::runDma() {
+  uint16_t first = reg16(EDMAST);
+  uint16_t last = reg16(EDMAND);
+  bool wrap = first >= reg16(ERXST) && first <= reg16(ERXND);
+  if (regs[ECON1] & ECON1_CSUMEN)
+    setReg16(EDMACS, checksum(first, last, wrap));
+  else {
+    uint16_t dest = reg16(EDMADST);
+    for (uint16_t addr = first;; addr = wrap ? ringNext(addr) : (addr + 1) & 0x1FFF) {
+      mem[dest] = mem[addr];
+      dest = (dest + 1) & 0x1FFF;
+      if (addr == last)
+        break;
+    }
+  }
+  regs[ECON1] &= ~ECON1_DMAST;
+  regs[EIR] |= EIR_DMAIF;
+}
+
+void Enc28j60Model::runBist(uint8_t mode) {
+  uint8_t seed = regs[EBSTSD];
+  for (uint16_t addr = 0; addr < sizeof mem; ++addr) {
+    switch (mode) {
+      case 0x04:  // address fill
+        mem[addr] = addr;
+        break;
+      case 0x08:  // pattern shift
+        mem[addr] = seed;
+        seed = seed << 1 | seed >> 7;
+        break;
+      default:  // random fill
+        seed = seed * 109 + 89;
+        mem[addr] = seed;
+        break;
+    }
+  }
+  setReg16(EBSTCS, checksum(0, sizeof mem - 1, false));
+  regs[EBSTCON] &= ~EBSTCON_BISTST;
+}
+
+bool Enc28j60Model::accept(const uint8_t* frame, uint16_t len) const {
+  uint8_t filters = regs[ERXFCON] & (ERXFCON_UCEN | ERXFCON_PMEN | ERXFCON_HTEN | ERXFCON_MCEN | ERXFCON_BCEN);
+  if (filters == 0)
+    return true;  // promiscuous
+
+  static const uint8_t broadcast[6] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+  const uint8_t mac[6] = { regs[MAADR5], regs[MAADR4], regs[MAADR3], regs[MAADR2], regs[MAADR1], regs[MAADR0] };
+  uint8_t matched = 0;
+  if (memcmp(frame, mac, 6) == 0)
+    matched |= ERXFCON_UCEN;
+  if (memcmp(frame, broadcast, 6) == 0)
+    matched |= ERXFCON_BCEN;
+  else if (frame[0] & 0x01)
+    matched |= ERXFCON_MCEN;
+  uint8_t ptr = hashPointer(frame);
+  if (regs[EHT0 + (ptr >> 3)] & (1 << (ptr & 7)))
+    matched |= ERXFCON_HTEN;
+
+  uint16_t offset = reg16(EPMO);
+  if (offset + 64 <= len) {
+    uint32_t sum = 0;
+    bool high = true;
+    for (uint8_t i = 0; i < 64; ++i)
+      if (regs[EPMM0 + (i >> 3)] & (1 << (i & 7))) {
+        sum += high ? frame[offset + i] << 8 : frame[offset + i];
+        high = !high;
+      }
+    if ((uint16_t)~fold(sum) == (regs[EPMCS] | regs[EPMCS + 1] << 8))
+      matched |= ERXFCON_PMEN;
+  }
+
+  if (regs[ERXFCON] & ERXFCON_ANDOR)
+    return (matched & filters) == filters;
+  return (matched & filters) != 0;
+}
+
+bool Enc28j60Model::receive(const uint8_t* frame, uint16_t len) {
+  if (!(regs[ECON1] & ECON1_RXEN) || len < 14)
+    return false;
+  if (!accept(frame, len)) {
+    ++filtered;
+    return false;
+  }
+
+  uint16_t start = reg16(ERXST), end = reg16(ERXND);
+  uint16_t wr = reg16(ERXWRPT), rd = reg16(ERXRDPT);
+  uint16_t size = end - start + 1;
+  uint16_t used = wr >= rd ? wr - rd : size - (rd - wr);
+  uint16_t total = len + 4;
+  uint16_t need = (6 + total + 1) & ~1;
+  if (regs[EPKTCNT] == 0xFF || used + need >= size) {
+    regs[EIR] |= EIR_RXERIF;
+    ++overflows;
+    updateInt();
+    return false;
+  }
+
+  uint16_t next = wr + need;
+  if (next > end)
+    next -= size;
+  uint32_t fcs = crc32(frame, len);
+  uint8_t header[6] = { (uint8_t)next, (uint8_t)(next >> 8), (uint8_t)total, (uint8_t)(total >> 8), 0x80, 0x00 };
+  if (frame[0] & 0x01)
+    header[5] |= memcmp(frame, "\xFF\xFF\xFF\xFF\xFF\xFF", 6) == 0 ? 0x02 : 0x01;
+  uint16_t addr = wr;
+  for (uint8_t i = 0; i < sizeof header; ++i, addr = ringNext(addr))
+    mem[addr] = header[i];
+  for (uint16_t i = 0; i < len; ++i, addr = ringNext(addr))
+    mem[addr] = frame[i];
+  for (uint8_t i = 0; i < 4; ++i, addr = ringNext(addr))
+    mem[addr] = fcs >> (8 * i);
+
+  setReg16(ERXWRPT, next);
+  ++regs[EPKTCNT];
+  regs[EIR] |= EIR_PKTIF;
+  updateInt();
+  return true;
+}
+
+void Enc28j60Model::transmit() {
+  uint16_t start = reg16(ETXST);
+  uint16_t end = reg16(ETXND);
+  uint8_t control = mem[start];
+  uint16_t len = end - start;
+  uint8_t frame[0x600];
+  if (len > sizeof frame)
+    len = sizeof frame;
+  memcpy(frame, mem + start + 1, len);
+  bool pad = (control & PKTCTRL_POVERRIDE) ? (control & PKTCTRL_PPADEN) : (regs[MACON3] & MACON3_PADCFG0);
+  if (pad && len < MIN_FRAME) {
+    memset(frame + len, 0, MIN_FRAME - len);
+    len = MIN_FRAME;
+  }
+
+  // transmit status vector behind the frame: byte count and "transmit done"
+  uint8_t tsv[7] = { (uint8_t)len, (uint8_t)(len >> 8), 0x80, 0, 0, 0, 0 };
+  for (uint8_t i = 0; i < sizeof tsv; ++i)
+    mem[(end + 1 + i) & 0x1FFF] = tsv[i];
+  regs[ECON1] &= ~ECON1_TXRTS;
+  regs[EIR] |= EIR_TXIF;
+  ++transmitted;
+  updateInt();
+
+  if (txHandler)
+    txHandler(txContext, frame, len);
+}
+
+void Enc28j60Model::updateInt() {
+  if (intPin == 0xFF)
+    return;
+  bool asserted = (regs[EIE] & EIE_INTIE) && (regs[EIR] & regs[EIE] & 0x7B);
+  hostSetPin(intPin, asserted ? LOW : HIGH);
+}
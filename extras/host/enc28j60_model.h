@@ -0,0 +1,117 @@
+// Software model of the Microchip ENC28J60 for host builds
+// Copyright: GPL V2
+//
+// The model sits on the far side of the SPI bus: it decodes the opcodes the
+// driver clocks out through HostSpiBus (see host_spi_bus.h) and keeps the
+// control registers, the 8 KB buffer memory and the PHY registers. Covered are
+// the register banks, buffer memory access with auto increment and RX ring
+// wrap, the RX ring with EPKTCNT/ERXRDPT and overflow, the receive filters,
+// transmission through ECON1.TXRTS with the status vector, DMA copy and
+// checksum, BIST fills, MII reads, writes and scans, link changes and the INT
+// output. Timing is not modelled: transmissions and DMA finish at once. The one
+// exception is the first result of an MII scan, which only lands in MIRD once
+// the driver has polled MISTAT.NVALID.
+/** @file */
+
+#ifndef ENC28J60_MODEL_H
+#define ENC28J60_MODEL_H
+
+#include <stdint.h>
+
+class Enc28j60Model {
+public:
+  /** Called with every frame the driver transmits, without padding beyond 60 bytes and without FCS */
+  typedef void (*TransmitHandler)(void* context, const uint8_t* frame, uint16_t len);
+
+  /**   @brief  Create a chip wired to the given pins
+    *     @param  csPin Chip select, the model listens to writes of this pin
+    *     @param  intPin Pin the INT output drives, 0xFF if not connected
+    */
+  Enc28j60Model(uint8_t csPin, uint8_t intPin = 0xFF);
+  ~Enc28j60Model();
+
+  /** Power-on reset; the buffer memory keeps its content like on the real chip */
+  void reset();
+
+  /**   @brief  Put a frame on the wire towards the chip
+    *     @param  frame Ethernet frame without FCS
+    *     @param  len Length of the frame
+    *     @return <i>bool</i> True if the frame passed the filters and fit into the RX ring
+    */
+  bool receive(const uint8_t* frame, uint16_t len);
+
+  /** Set the handler for transmitted frames */
+  void setTransmitHandler(TransmitHandler handler, void* context);
+
+  /** Change the link state, raising the link change interrupt if the driver enabled it */
+  void setLink(bool up);
+
+  bool isLinkUp() const {
+    return linkUp;
+  }
+
+  uint8_t packetCount() const;
+
+  uint32_t rxOverflows() const {
+    return overflows;
+  }
+
+  uint32_t rxFiltered() const {
+    return filtered;
+  }
+
+  uint32_t txFrames() const {
+    return transmitted;
+  }
+
+  /** The buffer memory, for inspection */
+  uint8_t* memory() {
+    return mem;
+  }
+
+  /** Chip whose chip select is low, NULL if none */
+  static Enc28j60Model* selected() {
+    return active;
+  }
+
+  /** Exchange one byte over SPI with the selected chip */
+  uint8_t transfer(uint8_t data);
+
+private:
+  enum State { IDLE, OPCODE, READ_CTRL, WRITE_CTRL, SET_BITS, CLEAR_BITS, READ_BUF, WRITE_BUF, DONE };
+
+  static void chipSelect(void* context, uint8_t pin, uint8_t level);
+  static Enc28j60Model* active;
+
+  uint8_t key(uint8_t address) const;
+  uint8_t readReg(uint8_t address);
+  void writeReg(uint8_t address, uint8_t value);
+  uint16_t reg16(uint8_t key) const;
+  void setReg16(uint8_t key, uint16_t value);
+  uint16_t ringNext(uint16_t addr) const;
+  bool accept(const uint8_t* frame, uint16_t len) const;
+  uint16_t checksum(uint16_t first, uint16_t last, bool wrap) const;
+  void transmit();
+  void runDma();
+  void runBist(uint8_t mode);
+  uint16_t readPhy(uint8_t address);
+  void writePhy(uint8_t address, uint16_t value);
+  void updateInt();
+
+  uint8_t csPin;
+  uint8_t intPin;
+  State state;
+  uint8_t arg;
+  uint8_t regs[128];
+  uint16_t phy[32];
+  uint8_t mem[0x2000];
+  bool linkUp;
+  bool scanning;
+  uint32_t overflows;
+  uint32_t filtered;
+  uint32_t transmitted;
+  TransmitHandler txHandler;
+  void* txContext;
+};
+
+#endif
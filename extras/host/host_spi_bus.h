@@ -0,0 +1,40 @@
+// SPI bus policy connecting the ENC28J60 driver to Enc28j60Model on a host
+// Copyright: GPL V2
+//
+// Force-included into enc28j60.cpp together with -DENC28J60_BUS=HostSpiBus,
+// see README.md. The chip selected by its chip select pin answers the bytes.
+
+#ifndef HOST_SPI_BUS_H
+#define HOST_SPI_BUS_H
+
+#include <SPI.h>
+#include "enc28j60_model.h"
+
+struct HostSpiBus {
+  static void init() {}
+
+  static void setClock(uint32_t) {}
+
+  static void useBus(SPIClass*) {}  // the model is found by its chip select pin
+
+  static void begin() {}
+
+  static void end() {}
+
+  static uint8_t transfer(uint8_t data) {
+    Enc28j60Model* chip = Enc28j60Model::selected();
+    return chip ? chip->transfer(data) : 0xFF;
+  }
+
+  static void read(uint8_t* data, uint16_t len) {
+    while (len--)
+      *data++ = transfer(0x00);
+  }
+
+  static void write(const uint8_t* data, uint16_t len) {
+    while (len--)
+      transfer(*data++);
+  }
+};
+
+#endif
@@ -0,0 +1,153 @@
+// pcap capture files for the host build
+// Copyright: GPL V2
+
+#include "pcap_io.h"
+#include <Arduino.h>
+
+#define PCAP_MAGIC 0xA1B2C3D4
+#define PCAP_MAGIC_NS 0xA1B23C4D
+#define LINKTYPE_ETHERNET 1
+#define SERVICE_LIMIT 1000  // calls to drain the RX ring before giving up
+
+static void put32(uint8_t* p, uint32_t v) {
+  memcpy(p, &v, 4);  // written in host order, readers go by the magic
+}
+
+uint32_t PcapReader::field(const uint8_t* p) const {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  if (swapped)
+    v = __builtin_bswap32(v);
+  return v;
+}
+
+bool PcapReader::open(const char* path) {
+  close();
+  file = fopen(path, "rb");
+  if (file == NULL)
+    return false;
+  uint8_t header[24];
+  if (fread(header, sizeof header, 1, file) != 1) {
+    close();
+    return false;
+  }
+  uint32_t magic;
+  memcpy(&magic, header, 4);
+  swapped = magic == __builtin_bswap32(PCAP_MAGIC) || magic == __builtin_bswap32(PCAP_MAGIC_NS);
+  magic = field(header);
+  nanoseconds = magic == PCAP_MAGIC_NS;
+  if ((magic != PCAP_MAGIC && !nanoseconds) || (field(header + 20) & 0xFFFF) != LINKTYPE_ETHERNET) {
+    close();
+    return false;
+  }
+  return true;
+}
+
+void PcapReader::close() {
+  if (file)
+    fclose(file);
+  file = NULL;
+}
+
+bool PcapReader::next(uint8_t* frame, uint16_t& len, uint64_t& us) {
+  uint8_t record[16];
+  if (file == NULL || fread(record, sizeof record, 1, file) != 1)
+    return false;
+  uint32_t sub = field(record + 4);
+  us = (uint64_t)field(record) * 1000000 + (nanoseconds ? sub / 1000 : sub);
+  uint32_t caplen = field(record + 8);
+  len = caplen > PCAP_SNAPLEN ? PCAP_SNAPLEN : caplen;
+  if (fread(frame, 1, len, file) != len)
+    return false;
+  return caplen == len || fseek(file, caplen - len, SEEK_CUR) == 0;
+}
+
+bool PcapWriter::open(const char* path) {
+  close();
+  file = fopen(path, "wb");
+  if (file == NULL)
+    return false;
+  uint8_t header[24] = { 0 };
+  put32(header, PCAP_MAGIC);
+  uint16_t major = 2, minor = 4;
+  memcpy(header + 4, &major, 2);
+  memcpy(header + 6, &minor, 2);
+  put32(header + 16, PCAP_SNAPLEN);
+  put32(header + 20, LINKTYPE_ETHERNET);
+  return fwrite(header, sizeof header, 1, file) == 1;
+}
+
+void PcapWriter::close() {
+  if (file)
+    fclose(file);
+  file = NULL;
+}
+
+void PcapWriter::write(const uint8_t* frame, uint16_t len) {
+  if (file == NULL)
+    return;
+  uint64_t now = micros();
+  uint8_t record[16];
+  put32(record, now / 1000000);
+  put32(record + 4, now % 1000000);
+  put32(record + 8, len);
+  put32(record + 12, len);
+  fwrite(record, sizeof record, 1, file);
+  fwrite(frame, 1, len, file);
+}
+
+PcapReplay::PcapReplay(Enc28j60Model& chip, void (*service)())
+  : chip(chip), service(service), recording(false), dropped(0) {
+  chip.setTransmitHandler(onTransmit, this);
+}
+
+void PcapReplay::onTransmit(void* context, const uint8_t* frame, uint16_t len) {
+  PcapReplay* replay = (PcapReplay*)context;
+  if (replay->recording)
+    replay->writer.write(frame, len);
+}
+
+bool PcapReplay::record(const char* path) {
+  writer.close();
+  recording = path && writer.open(path);
+  return recording || path == NULL;
+}
+
+// lets the stack empty the RX ring before the next frame goes in
+void PcapReplay::drain() {
+  for (uint16_t n = 0; chip.packetCount() > 0 && n < SERVICE_LIMIT; ++n)
+    service();
+}
+
+long PcapReplay::replay(const char* path, PcapPacing pacing) {
+  PcapReader reader;
+  if (!reader.open(path))
+    return -1;
+
+  if (pacing == PCAP_VIRTUAL)
+    hostUseVirtualTime(true);  // and stay on it, the clock must not jump back afterwards
+  uint8_t frame[PCAP_SNAPLEN];
+  uint16_t len;
+  uint64_t at, first = 0, startClock = micros();
+  long count = 0;
+  while (reader.next(frame, len, at)) {
+    if (count == 0)
+      first = at;
+    uint64_t due = startClock + (at > first ? at - first : 0);
+    if (pacing == PCAP_VIRTUAL && micros() < due)
+      hostAdvanceMicros(due - micros());
+    else if (pacing == PCAP_REALTIME)
+      while (micros() < due)
+        service();  // keep timers and retransmissions running meanwhile
+
+    if (chip.receive(frame, len)) {
+      if (recording)
+        writer.write(frame, len);
+    } else
+      ++dropped;
+    ++count;
+    drain();
+  }
+  service();
+  return count;
+}
@@ -0,0 +1,104 @@
+// pcap capture files for the host build: replaying captures into an
+// Enc28j60Model and recording everything the chip receives and sends
+// Copyright: GPL V2
+//
+// Only classic libpcap files with Ethernet link type are handled, in either
+// byte order and with micro- or nanosecond timestamps; pcapng is not.
+/** @file */
+
+#ifndef PCAP_IO_H
+#define PCAP_IO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "enc28j60_model.h"
+
+#define PCAP_SNAPLEN 1536
+
+/** Reads the frames of a capture file one by one */
+class PcapReader {
+public:
+  PcapReader() : file(NULL) {}
+  ~PcapReader() {
+    close();
+  }
+
+  /** Open a capture, false if it cannot be read or is not an Ethernet capture */
+  bool open(const char* path);
+  void close();
+
+  /**   @brief  Read the next frame
+    *     @param  frame Buffer of PCAP_SNAPLEN bytes, longer frames are clipped
+    *     @param  len Length of the frame in the buffer
+    *     @param  us Capture time in microseconds
+    *     @return <i>bool</i> False at the end of the file
+    */
+  bool next(uint8_t* frame, uint16_t& len, uint64_t& us);
+
+private:
+  uint32_t field(const uint8_t* p) const;
+
+  FILE* file;
+  bool swapped;
+  bool nanoseconds;
+};
+
+/** Writes frames to a capture file */
+class PcapWriter {
+public:
+  PcapWriter() : file(NULL) {}
+  ~PcapWriter() {
+    close();
+  }
+
+  bool open(const char* path);
+  void close();
+
+  /** Append a frame stamped with the current micros() */
+  void write(const uint8_t* frame, uint16_t len);
+
+private:
+  FILE* file;
+};
+
+/** Pacing of PcapReplay */
+enum PcapPacing {
+  PCAP_FAST,      ///< Inject the next frame as soon as the stack has taken the previous one
+  PCAP_REALTIME,  ///< Keep the gaps of the capture on the host clock
+  PCAP_VIRTUAL    ///< Keep the gaps on the virtual clock, i.e. as seen by millis(), without waiting
+};
+
+/** Feeds a capture into a chip model and optionally records its traffic.
+*   Between frames the replay calls the given service function, which should run
+*   ether.packetLoop(ether.packetReceive()) once.
+*/
+class PcapReplay {
+public:
+  PcapReplay(Enc28j60Model& chip, void (*service)());
+
+  /** Record every frame the chip accepts or transmits from now on, NULL to stop */
+  bool record(const char* path);
+
+  /**   @brief  Replay a capture
+    *     @param  path Capture file
+    *     @param  pacing See PcapPacing
+    *     @return <i>long</i> Frames injected, -1 if the file cannot be read
+    */
+  long replay(const char* path, PcapPacing pacing);
+
+  uint32_t rejected() const {
+    return dropped;
+  }
+
+private:
+  static void onTransmit(void* context, const uint8_t* frame, uint16_t len);
+  void drain();
+
+  Enc28j60Model& chip;
+  void (*service)();
+  PcapWriter writer;
+  bool recording;
+  uint32_t dropped;
+};
+
+#endif
@@ -0,0 +1,114 @@
+// Replays a capture through the EtherCard stack on the host, see README.md
+// Copyright: GPL V2
+//
+//   replay [-r|-v] [-o out.pcap] [-m mac] [-i ip] [-g gateway] in.pcap
+//
+// -r keeps the gaps of the capture in real time, -v on the virtual clock;
+// without either frames go in as fast as the stack takes them.
+
+#include <EtherCard.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include "pcap_io.h"
+
+byte Ethernet::buffer[1518];
+
+static byte mymac[] = { 0x74, 0x69, 0x69, 0x2D, 0x30, 0x31 };
+static byte myip[] = { 192, 168, 1, 203 };
+static byte gwip[] = { 192, 168, 1, 1 };
+
+static void service() {
+  ether.packetLoop(ether.packetReceive());
+}
+
+static bool parseMac(const char* s, byte* mac) {
+  unsigned v[6];
+  if (sscanf(s, "%x:%x:%x:%x:%x:%x", &v[0], &v[1], &v[2], &v[3], &v[4], &v[5]) != 6)
+    return false;
+  for (byte i = 0; i < 6; ++i)
+    mac[i] = v[i];
+  return true;
+}
+
+static bool parseIp(const char* s, byte* ip) {
+  unsigned v[4];
+  if (sscanf(s, "%u.%u.%u.%u", &v[0], &v[1], &v[2], &v[3]) != 4)
+    return false;
+  for (byte i = 0; i < 4; ++i)
+    ip[i] = v[i];
+  return true;
+}
+
+static double seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv) {
+  PcapPacing pacing = PCAP_FAST;
+  const char* out = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "rvo:m:i:g:")) != -1) {
+    bool ok = true;
+    switch (opt) {
+      case 'r':
+        pacing = PCAP_REALTIME;
+        break;
+      case 'v':
+        pacing = PCAP_VIRTUAL;
+        break;
+      case 'o':
+        out = optarg;
+        break;
+      case 'm':
+        ok = parseMac(optarg, mymac);
+        break;
+      case 'i':
+        ok = parseIp(optarg, myip);
+        break;
+      case 'g':
+        ok = parseIp(optarg, gwip);
+        break;
+      default:
+        ok = false;
+    }
+    if (!ok)
+      optind = argc;
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr, "usage: %s [-r|-v] [-o out.pcap] [-m mac] [-i ip] [-g gateway] in.pcap\n", argv[0]);
+    return 2;
+  }
+
+  Enc28j60Model nic(ENC28J60_CS_PIN);
+  PcapReplay replay(nic, service);
+  if (ether.begin(sizeof Ethernet::buffer, mymac) == 0) {
+    fprintf(stderr, "ENC28J60 model not found\n");
+    return 1;
+  }
+  if (out && !replay.record(out)) {
+    fprintf(stderr, "cannot write %s\n", out);
+    return 1;
+  }
+  ether.staticSetup(myip, gwip);
+
+  ENC28J60::resetStats();
+  double start = seconds();
+  long frames = replay.replay(argv[optind], pacing);
+  double elapsed = seconds() - start;
+  if (frames < 0) {
+    fprintf(stderr, "cannot read %s\n", argv[optind]);
+    return 1;
+  }
+
+  NetStats stats;
+  ENC28J60::getStats(stats);
+  printf("%ld frames in %.3f s, %.0f frames/s\n", frames, elapsed, frames / elapsed);
+  printf("filtered by the chip %u, received %u, dropped %u, sent %u\n", (unsigned)replay.rejected(),
+         (unsigned)stats.rxFrames, (unsigned)stats.rxDropped, (unsigned)stats.txFrames);
+  printf("arp %u, icmp %u, udp %u, tcp %u\n", (unsigned)stats.arp, (unsigned)stats.icmp,
+         (unsigned)stats.udp, (unsigned)stats.tcp);
+  return 0;
+}
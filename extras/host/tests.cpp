@@ -0,0 +1,176 @@
+// Regression tests of the driver against Enc28j60Model, see README.md
+// Copyright: GPL V2
+
+#include <EtherCard.h>
+#include <stdio.h>
+#include "enc28j60_model.h"
+
+byte Ethernet::buffer[700];
+
+static const byte mymac[] = { 0x74, 0x69, 0x69, 0x2D, 0x30, 0x31 };
+
+static int failures;
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      printf("%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+      ++failures; \
+    } \
+  } while (0)
+
+static int linkCalls;
+static bool linkArg;
+
+static void onLink(bool up) {
+  ++linkCalls;
+  linkArg = up;
+}
+
+// let the next packetReceive() look for a link change
+static void pollLink() {
+  hostAdvanceMicros(1000000);
+  ether.packetReceive();
+}
+
+// With the PHY scan on, the link callback must see the new state and not
+// what MIRD held after reading PHIR
+static void testLinkChangeWithPhyScan() {
+  Enc28j60Model nic(ENC28J60_CS_PIN);
+  CHECK(ether.begin(sizeof Ethernet::buffer, mymac) != 0);
+  ENC28J60::enablePhyScan();
+  ENC28J60::setLinkCallback(onLink);
+  pollLink();
+  linkCalls = 0;
+
+  nic.setLink(false);
+  pollLink();
+  CHECK(linkCalls == 1 && !linkArg);
+  CHECK(!ENC28J60::isLinkUp());
+
+  nic.setLink(true);
+  pollLink();
+  CHECK(linkCalls == 2 && linkArg);
+  CHECK(ENC28J60::isLinkUp());
+  CHECK(ENC28J60::getPhyStatus() & ENC28J60_PHY_LINK);
+
+  ENC28J60::setLinkCallback(NULL);
+  ENC28J60::disablePhyScan();
+}
+
+// An application that only receives in batches still gets link changes
+static void testBatchReceiveServicesLink() {
+  Enc28j60Model nic(ENC28J60_CS_PIN);
+  CHECK(ether.begin(sizeof Ethernet::buffer, mymac) != 0);
+  ENC28J60::setLinkCallback(onLink);
+  linkCalls = 0;
+
+  static byte data[4][600];
+  PacketDescriptor ring[4];
+  for (int i = 0; i < 4; ++i) {
+    ring[i].data = data[i];
+    ring[i].size = sizeof data[i];
+  }
+  nic.setLink(false);
+  hostAdvanceMicros(1000000);
+  ENC28J60::packetReceiveBatch(ring, 4);
+  CHECK(linkCalls == 1 && !linkArg);
+
+  nic.setLink(true);
+  hostAdvanceMicros(1000000);
+  ENC28J60::packetReceiveBatch(ring, 4);
+  CHECK(linkCalls == 2 && linkArg);
+  ENC28J60::setLinkCallback(NULL);
+}
+
+static byte sent[1518];
+static uint16_t sentLen;
+
+static void onTransmit(void* /* context */, const uint8_t* frame, uint16_t len) {
+  memcpy(sent, frame, len);
+  sentLen = len;
+}
+
+// The priority (PCP) and drop eligible (DEI) bits of the 802.1Q tag go out as
+// set and are read back from a received tag
+static void testVlanPriorityRoundTrip() {
+  Enc28j60Model nic(ENC28J60_CS_PIN);
+  nic.setTransmitHandler(onTransmit, NULL);
+  CHECK(ether.begin(sizeof Ethernet::buffer, mymac) != 0);
+  ENC28J60::enable_VLAN_tagging(100);
+  ENC28J60::vlan_TCI_PCP = 5;
+  ENC28J60::vlan_TCI_DEI = 1;
+
+  memset(Ethernet::buffer, 0, 60);
+  memcpy(Ethernet::buffer, mymac, 6);  // back to ourselves
+  Ethernet::buffer[6] = 0x02;
+  Ethernet::buffer[12] = 0x88;
+  Ethernet::buffer[13] = 0xB5;
+  sentLen = 0;
+  ENC28J60::packetSend(60);
+  CHECK(sentLen == 64);
+  CHECK(sent[12] == 0x81 && sent[13] == 0x00);
+  CHECK(sent[14] == (5 << 5 | 1 << 4) && sent[15] == 100);
+  CHECK(sent[16] == 0x88 && sent[17] == 0xB5);
+
+  ENC28J60::vlan_TCI_PCP = 0;
+  ENC28J60::vlan_TCI_DEI = 0;
+  CHECK(nic.receive(sent, sentLen));
+  CHECK(ENC28J60::packetReceive() == 60);
+  CHECK(ENC28J60::packet_Received_Was_Tagged());
+  CHECK(ENC28J60::vlan_TCI_PCP == 5 && ENC28J60::vlan_TCI_DEI == 1);
+  CHECK(Ethernet::buffer[12] == 0x88 && Ethernet::buffer[13] == 0xB5);
+
+  ENC28J60::disable_VLAN_tagging();
+}
+
+// captureSend() must not write past the data buffer when it is too small for
+// a whole record
+static void testCaptureSendSmallBuffer() {
+  static const byte myip[] = { 192, 168, 1, 203 };
+  static const byte collector[] = { 192, 168, 1, 10 };
+  static byte ring[2048];
+  Enc28j60Model nic(ENC28J60_CS_PIN);
+  CHECK(ether.begin(sizeof Ethernet::buffer, mymac) != 0);
+  ether.staticSetup(myip);
+  CHECK(ENC28J60::setCapture(ring, sizeof ring));
+
+  byte frame[60] = {};
+  memcpy(frame, mymac, 6);
+  frame[6] = 0x02;
+  frame[12] = 0x88;
+  frame[13] = 0xB5;
+  for (int i = 0; i < 3; ++i) {
+    nic.receive(frame, sizeof frame);
+    ether.packetLoop(ether.packetReceive());
+  }
+
+  // room for the UDP header and 8 bytes: not even a record header fits
+  ENC28J60::bufferSize = UDP_DATA_P + 8;
+  memset(Ethernet::buffer + ENC28J60::bufferSize, 0xEE, 64);
+  CHECK(ether.captureSend(collector, 5555, 5555) == 0);
+  CHECK(Ethernet::buffer[ENC28J60::bufferSize] == 0xEE);
+
+  // a record header and 2 bytes: the first record is clipped
+  ENC28J60::bufferSize = UDP_DATA_P + 16 + 2;
+  memset(Ethernet::buffer + ENC28J60::bufferSize, 0xEE, 64);
+  CHECK(ether.captureSend(collector, 5555, 5555) == 1);
+  CHECK(Ethernet::buffer[ENC28J60::bufferSize] == 0xEE);
+
+  // with the file header in front nothing fits
+  CHECK(ether.captureSend(collector, 5555, 5555, true) == 0);
+  CHECK(Ethernet::buffer[ENC28J60::bufferSize] == 0xEE);
+
+  ENC28J60::bufferSize = sizeof Ethernet::buffer;
+  ENC28J60::setCapture(NULL, 0);
+}
+
+int main() {
+  hostUseVirtualTime(true);
+  testLinkChangeWithPhyScan();
+  testBatchReceiveServicesLink();
+  testCaptureSendSmallBuffer();
+  testVlanPriorityRoundTrip();
+  printf("%s\n", failures ? "FAILED" : "all tests passed");
+  return failures != 0;
+}